@@ -13,253 +13,617 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <cstdlib>
-#include <set>
+#include <cstring>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <bitset>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
+#include "consistency-checker.h"
 
 using namespace std;
 
-#define MAX_THREADS 6
-#define MAX_INSTRUCTIONS 10
+#define MAX_THREADS 16
+#define MAX_INSTRUCTIONS 64
+#define MAX_SLOTS (MAX_THREADS*MAX_INSTRUCTIONS)
+
+// Hot-path counters and progress reports, compiled in with -DSTATS
+#ifdef STATS
+#define STAT(x) (x)
+#else
+#define STAT(x)
+#endif
 
 typedef struct instr_ {
   bool store;
-  string mem;
+  int mem; // variable ID
   int value;
 } Instr;
 
-Instr program[MAX_THREADS][MAX_INSTRUCTIONS];
-int num_threads = 0;
-int num_instrs[MAX_THREADS];
-int max_instrs = 0;
+// Program order: bit d of po[t][i] is set if instruction i of
+// thread t has to wait for instruction d of the same thread
+typedef uint64_t InstrMask;
+static_assert(MAX_INSTRUCTIONS <= 64, "InstrMask holds a thread");
 
+// Outcomes are packed as the final memory values followed by the
+// load values in thread order, and only formatted when printed
+typedef vector<int> Outcome;
 
-// Program order
-bool po[MAX_THREADS][MAX_INSTRUCTIONS][MAX_INSTRUCTIONS];
+inline uint64_t hash_values(const int* values, size_t num_values) {
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (size_t pos = 0; pos < num_values; pos++) {
+    h = (h ^ (uint32_t)values[pos]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+struct OutcomeHash {
+  size_t operator()(const Outcome& o) const {
+    return hash_values(o.data(), o.size());
+  }
+};
+
+typedef unordered_set<Outcome, OutcomeHash> Solutions;
+typedef unordered_map<Outcome, long long, OutcomeHash> OutcomeCounts;
+
+// A set of outcomes of the same size, for streaming: the outcomes are
+// rows of a single vector, found through an open-addressing index of
+// row numbers, so that each only takes its values and a few bytes
+struct OutcomeRows {
+  size_t width;
+  size_t num_rows;
+  vector<int> rows;
+  vector<uint32_t> index; // row + 1, or 0 if the slot is empty
 
-void add_po_ibm(int t, int i) {
-  for (int d = 0; d < i+1; d++) {
-    po[t][d][i] = false;
+  OutcomeRows() : width(0), num_rows(0) {}
+
+  size_t size() const {
+    return num_rows;
   }
-  for (int d = i+1; d < num_instrs[t]; d++) {
-    po[t][d][i] = false;
-    if (program[t][i].store) {
-      if (program[t][d].store) {
-	po[t][d][i] = true;
-      } else if (program[t][i].mem == program[t][d].mem) {
-	po[t][d][i] = true;
+
+  // Adds o; false if it was already there
+  bool insert(const Outcome& o) {
+    if (2 * (num_rows + 1) > index.size()) grow(o.size());
+    size_t mask = index.size() - 1;
+    for (size_t slot = hash_values(o.data(), width) & mask; ; slot = (slot + 1) & mask) {
+      if (index[slot] == 0) {
+	rows.insert(rows.end(), o.begin(), o.end());
+	index[slot] = ++num_rows;
+	return true;
+      }
+      if (equal(o.begin(), o.end(), rows.begin() + (index[slot] - 1) * width)) {
+	return false;
       }
-    } else { // load
-      po[t][d][i] = true;
     }
   }
-}
 
-void add_po_tso(int t, int i) {
-  for (int d = 0; d < i+1; d++) {
-    po[t][d][i] = false;
-  }
-  for (int d = i+1; d < num_instrs[t]; d++) {
-    po[t][d][i] = false;
-    if (program[t][i].store) {
-      if (program[t][d].store) {
-	po[t][d][i] = true;
-      }
-    } else { // load
-      po[t][d][i] = true;
+  void grow(size_t outcome_size) {
+    width = outcome_size;
+    vector<uint32_t> old(max((size_t)64, 2 * index.size()), 0);
+    old.swap(index);
+    size_t mask = index.size() - 1;
+    for (size_t k = 0; k < old.size(); k++) {
+      if (old[k] == 0) continue;
+      size_t slot = hash_values(&rows[(old[k] - 1) * width], width) & mask;
+      while (index[slot] != 0) slot = (slot + 1) & mask;
+      index[slot] = old[k];
     }
   }
-}
+};
 
-void remove_po(int t, int i) {
-  for (int d = i+1; d < num_instrs[t]; d++) {
-    po[t][d][i] = false;
+// The outcomes a context streamed last, with the models they were
+// streamed for (bit 0 for the store-atomic variant, bit 1 for the
+// relaxed model), in a direct-mapped cache of RECENT_OUTCOMES rows. An
+// outcome found there is a duplicate, so most duplicates are dropped
+// by the worker that finds them, without taking the lock of the stream.
+#define RECENT_OUTCOMES 1024
+
+struct RecentOutcomes {
+  vector<int> rows;
+  vector<uint64_t> hashes;
+  vector<char> models;
+
+  void clear() {
+    rows.clear();
+    hashes.clear();
+    models.clear();
   }
-}
 
-// Build program order graph
-void build_po_graph_ibm() {
-  for (int t = 0; t < num_threads; t++) {
-    for (int i = 0; i < num_instrs[t]; i++) {
-      add_po_ibm(t, i);
+  // Records o as streamed for models, and returns those it was not
+  // streamed for yet, as far as the cache knows
+  int add(const Outcome& o, int new_models) {
+    if (rows.size() != RECENT_OUTCOMES * o.size()) {
+      rows.assign(RECENT_OUTCOMES * o.size(), 0);
+      hashes.assign(RECENT_OUTCOMES, 0);
+      models.assign(RECENT_OUTCOMES, 0);
     }
+    uint64_t h = hash_values(o.data(), o.size());
+    size_t slot = h % RECENT_OUTCOMES;
+    vector<int>::iterator row = rows.begin() + slot * o.size();
+    if (models[slot] != 0 && hashes[slot] == h && equal(o.begin(), o.end(), row)) {
+      new_models &= ~models[slot];
+      models[slot] |= new_models;
+      return new_models;
+    }
+    copy(o.begin(), o.end(), row);
+    hashes[slot] = h;
+    models[slot] = new_models;
+    return new_models;
   }
-}
+};
 
-void build_po_graph_tso() {
-  for (int t = 0; t < num_threads; t++) {
-    for (int i = 0; i < num_instrs[t]; i++) {
-      add_po_tso(t, i);
-    }
+// Formatted solutions in lexicographic order of their text
+typedef vector<pair<string, const Outcome*> > SortedSolutions;
+
+const CheckerOptions default_options;
+
+// Models a query asks about
+#define QUERY_IBM 1
+#define QUERY_TSO 2
+
+// The command line: the options of a check, and those of the input
+// and the output
+struct CommandLine : CheckerOptions {
+  string query;        // target outcome of the query mode
+  int query_models;    // models the query asks about, QUERY_*
+  string projection;   // terms that make up an outcome, if not all
+  bool streaming;      // print solutions as they are found
+  bool binary_output;  // write the solutions in the binary format
+  string cache_dir;    // results of the programs checked before
+
+  CommandLine() : query_models(QUERY_IBM | QUERY_TSO), streaming(false),
+		  binary_output(false) {}
+};
+
+struct SolutionStream;
+
+// An automorphism of a program: in the image of a state, thread t has
+// the state of thread from_thread[t], and variable v the value of
+// from_var[v]
+struct Renaming {
+  vector<int> from_thread;
+  vector<int> from_var;
+};
+
+// The plain data of a context, in two blocks: the sizes,
+// the per-thread data and the state of the search, copied whole, and
+// the tables indexed by instruction, slot or variable, sized for the
+// largest program but only copied up to the size of the program. A
+// worker copies little more than the part of the tables it uses, and
+// reusing a context for the next test of a batch does not allocate.
+struct ContextState {
+  // Options of the check, owned by its caller
+  const CheckerOptions* options;
+
+  // Program
+  int num_threads;
+  int num_instrs[MAX_THREADS];
+  int max_instrs;
+
+  // Executed: bit i of pending[t] is set while instruction i of
+  // thread t has not been executed. For the combined search, ibm_path
+  // tells whether the path that reached the current state is also an
+  // IBM370 execution.
+  InstrMask pending[MAX_THREADS];
+  int num_pending;
+  bool ibm_path;
+
+  // Explicit store buffers: the instructions of a thread issue in
+  // program order and stores wait in a FIFO buffer until they drain
+  // to memory. A store is executed when it drains, a load when it
+  // issues.
+  int issued[MAX_THREADS];
+  InstrMask store_mask[MAX_THREADS];
+
+  // Memory
+  int num_memvars;
+
+  // Statistics of the searches
+  long long num_explored;
+  long long num_pruned;
+  long long num_leaves;
+  long long num_walks; // random executions, when sampling
+  ostream* log;
+  SolutionStream* stream; // if set, solutions are streamed, not kept
+
+  // Query mode: bit i of target_loads[t] is set if the value of load
+  // i of thread t is fixed by the target outcome, which is asked about
+  // the models query_models
+  bool has_target;
+  int query_models;
+  InstrMask target_loads[MAX_THREADS];
+
+  // Projection: if projected, an outcome only holds the final values
+  // of the variables in project_var and the loads in project_loads[t].
+  // skipped[t] are the instructions of thread t that cannot change
+  // them, which the searches run before they start.
+  bool projected;
+  InstrMask project_loads[MAX_THREADS];
+  InstrMask skipped[MAX_THREADS];
+
+  // Partial-order reduction (sleep sets). Instructions are numbered
+  // in thread order; slot n of a sleep set is instruction n.
+  int first_slot[MAX_THREADS];
+  int num_slots;
+
+  // Symmetry reduction
+  bool symmetric;
+  int load_offset[MAX_THREADS]; // position of the loads of a thread in an outcome
+};
+
+static_assert(is_trivially_copyable<ContextState>::value, "ContextState is copied as a block");
+
+struct ContextArena : ContextState {
+  // Program, and program order (po_ibm is only used by the combined
+  // search, with the TSO graph in po)
+  Instr program[MAX_THREADS][MAX_INSTRUCTIONS];
+  InstrMask po[MAX_THREADS][MAX_INSTRUCTIONS];
+  InstrMask po_ibm[MAX_THREADS][MAX_INSTRUCTIONS];
+
+  // Explicit store buffers: prev_store[t][i] is the nearest store
+  // before load i to the same variable, or -1
+  int prev_store[MAX_THREADS][MAX_INSTRUCTIONS];
+
+  // Memory and loaded values. The name of variable v starts at
+  // name_start[v] in the names of the context.
+  int name_start[MAX_SLOTS];
+  int memvalues[MAX_SLOTS];
+  int loadvalues[MAX_THREADS][MAX_INSTRUCTIONS];
+
+  // Query mode: the value target_load[t][i] of each fixed load
+  int target_load[MAX_THREADS][MAX_INSTRUCTIONS];
+
+  // Projection
+  bool project_var[MAX_SLOTS];
+
+  // Partial-order reduction: the instruction of each slot
+  int slot_thread[MAX_SLOTS];
+  int slot_instr[MAX_SLOTS];
+
+  ContextArena() {}
+  ContextArena(const ContextArena& a) {
+    *this = a;
   }
+  ContextArena& operator=(const ContextArena& a);
+};
+
+// The rows of the threads, and the entries of the variables and slots
+#define COPY_USED(table, n) memcpy(table, a.table, (n) * sizeof(table[0]))
+
+ContextArena& ContextArena::operator=(const ContextArena& a) {
+  if (this == &a) return *this;
+  (ContextState&)*this = a;
+  COPY_USED(program, num_threads);
+  COPY_USED(po, num_threads);
+  COPY_USED(po_ibm, num_threads);
+  COPY_USED(prev_store, num_threads);
+  COPY_USED(loadvalues, num_threads);
+  COPY_USED(target_load, num_threads);
+  COPY_USED(name_start, num_memvars);
+  COPY_USED(memvalues, num_memvars);
+  COPY_USED(project_var, num_memvars);
+  COPY_USED(slot_thread, num_slots);
+  COPY_USED(slot_instr, num_slots);
+  return *this;
 }
 
-bool has_po_dependencies(int thread, int instr) {
-  for (int d = 0; d < num_instrs[thread]; d++) {
-    if (po[thread][instr][d]) return true;
+// A test: the arena, and the solutions and other data of variable
+// size. Every test of a batch has its own context, and every worker
+// of a parallel search a private copy.
+struct CheckerContext : ContextArena {
+  // Program
+  void reset();
+  bool parse(const char* begin, const char* end, int line, string& error);
+  void print_instr(ostream& out, Instr i);
+  void print_program(ostream& out);
+
+  // Program order
+  const char* store_atomic_name() const;
+  const char* relaxed_name() const;
+  template <typename Model> void build_po_graph();
+  void reset_po();
+  void build_po_graph_ibm();
+  void build_po_graph_tso();
+  void build_po_graph_both();
+
+  // Executed
+  InstrMask thread_mask(int t);
+  void reset_executed();
+  bool is_executed(int t, int i);
+  void set_executed(int t, int i);
+  void unset_executed(int t, int i);
+  bool has_po_dependencies(int thread, int instr);
+  bool all_executed();
+  bool is_prevstore(int thread, int instr);
+  bool is_prevstore_executed(int thread, int instr);
+  int get_prevstore(int thread, int instr);
+
+  // Explicit store buffers
+  void build_store_buffers();
+  InstrMask buffered(int t);
+
+  // Memory and loaded values. The names of the variables, each
+  // NUL-terminated, are not part of the arena: workers never change
+  // them, and they have no fixed limit.
+  string var_names;
+  const char* memvar(int var) const;
+  int insert_memvar(const char* var, size_t len);
+  int get_memvar(int var);
+  int update_memvar(int var, int value);
+  int update_load(int thread, int instr, int value);
+
+  // Solutions
+  Solutions solutions_ibm;
+  Solutions solutions_tso;
+  RecentOutcomes recent; // what this context streamed last, with -u
+
+  // Sampling: the number of random executions that reached each
+  // outcome, of the store-atomic and relaxed models
+  OutcomeCounts sample_counts[2];
+  void print_coverage(ostream& out);
+
+  // The outcome of the current leaf, gathered in place so that a leaf
+  // only allocates when its outcome is new to a solution set
+  Outcome leaf;
+  void gather_outcome();
+  void print_mem(ostream& out, const Outcome& o);
+  void print_loads(ostream& out, const Outcome& o);
+  string format_outcome(const Outcome& o);
+  SortedSolutions sort_solutions(const Solutions& sols);
+  vector<bool> breaks_store_atomicity(const SortedSolutions& sorted_ibm,
+				      const SortedSolutions& sorted_tso);
+  void print_solutions(ostream& out);
+  void write_results(ostream& out);
+  bool read_results(istream& in);
+  void record_outcome(const Outcome& o, bool ibm, bool tso);
+  void stream_outcome(const Outcome& o, bool ibm, bool tso);
+  void add_possible_execution_ibm();
+  void add_possible_execution_tso();
+  void add_possible_execution_both();
+
+  // Query mode: the final memory values fixed by the target outcome.
+  // For the k-th fixed variable, the stores to it in thread t are
+  // target_stores[k*MAX_THREADS+t], and those that store the target
+  // value target_matching[...].
+  vector<int> target_vars;
+  vector<int> target_values;
+  vector<InstrMask> target_stores;
+  vector<InstrMask> target_matching;
+
+  bool parse_target(const string& cond, int models, string& error);
+  bool may_reach_target();
+  void print_query(ostream& out, const string& query);
+
+  // Projection
+  bool parse_projection(const string& terms, string& error);
+  void skip_unprojected();
+
+  // Partial-order reduction
+  void build_slots();
+  bool are_independent(int t1, int i1, int t2, int i2);
+  template <typename SlotSet>
+  SlotSet next_sleep(const SlotSet& sleep, int t, int i);
+
+  // Symmetry reduction: the automorphisms of the program, permutations
+  // of its threads together with a renaming of its variables that map
+  // it onto itself. States that are images of each other under an
+  // automorphism reach the same outcomes up to it, so they are encoded
+  // alike, and every outcome found is added with all its images. The
+  // automorphisms that keep the variables permute identical threads,
+  // within the classes of symmetry_classes; any other is one of those
+  // composed with the automorphism of renamings that renames the
+  // variables the same way.
+  vector<vector<int> > symmetry_classes;
+  vector<Renaming> renamings;
+
+  void build_symmetry();
+  bool map_thread(int t, int u, vector<int>& var, vector<int>& inv);
+  void find_renamings(int t, vector<int>& image, vector<bool>& used,
+		      const vector<int>& first_identical,
+		      const vector<int>& var, const vector<int>& inv);
+  bool same_thread_state(int t1, int t2, bool less);
+  void add_symmetric_outcomes(const Outcome& o, bool ibm, bool tso);
+  void add_permuted_outcomes(const Outcome& o, bool ibm, bool tso, Outcome& image);
+
+  // Visited states
+  string encode_state();
+  string encode_image(const Renaming* r);
+  void decode_state(const string& key);
+
+  CheckerContext() {
+    options = &default_options;
+    reset();
   }
-  return false;
-}
+};
 
 
-// Executed
-bool executed[MAX_THREADS][MAX_INSTRUCTIONS];
+// Program order
+// Memory models: a model tells whether an instruction has to wait
+// for an earlier one of its thread. A load that runs before an
+// earlier store of its thread to the same variable reads it
+// (forwarding), so every relaxed model comes with a store-atomic
+// variant that also keeps that order; IBM370 is the variant of TSO.
+// The searches only see the model through the program order graph.
+struct TSO {
+  static bool ordered(const Instr& a, const Instr& b) {
+    return !a.store || b.store;
+  }
+};
 
-void reset_executed() {
-  for (int t = 0; t < num_threads; t++) {
-    for (int i = 0; i < num_instrs[t]; i++) {
-      executed[t][i] = false;
-    }
+// Stores to different variables are not ordered either
+struct PSO {
+  static bool ordered(const Instr& a, const Instr& b) {
+    return !a.store || (b.store && a.mem == b.mem);
+  }
+};
+
+// Only accesses to the same variable are ordered
+struct ARMLite {
+  static bool ordered(const Instr& a, const Instr& b) {
+    return a.mem == b.mem && (!a.store || b.store);
+  }
+};
+
+template <typename Model>
+struct StoreAtomic {
+  static bool ordered(const Instr& a, const Instr& b) {
+    return Model::ordered(a, b) || (a.store && !b.store && a.mem == b.mem);
   }
+};
+
+typedef StoreAtomic<TSO> IBM370;
+
+const char* model_names[][2] = {
+  {"IBM370", "TSO"}, {"PSO-SA", "PSO"}, {"ARM-lite-SA", "ARM-lite"},
+};
+
+const char* CheckerContext::store_atomic_name() const {
+  return model_names[options->model][0];
+}
+
+const char* CheckerContext::relaxed_name() const {
+  return model_names[options->model][1];
 }
 
-bool all_executed() {
+void CheckerContext::reset_po() {
   for (int t = 0; t < num_threads; t++) {
     for (int i = 0; i < num_instrs[t]; i++) {
-      if (!executed[t][i]) return false;
+      po[t][i] = 0;
     }
   }
-  return true;
 }
 
-
-// Memory and loaded values
-string memvars[MAX_THREADS*MAX_INSTRUCTIONS];
-int memvalues[MAX_THREADS*MAX_INSTRUCTIONS];
-int num_memvars = 0;
-int loadvalues[MAX_THREADS][MAX_INSTRUCTIONS];
-
-void insert_memvar(string var) {
-  for (int pos = 0; pos < num_memvars; pos++) {
-    if (memvars[pos].compare(var) == 0) {
-      return;
+// Build program order graph
+template <typename Model>
+void CheckerContext::build_po_graph() {
+  reset_po();
+  for (int t = 0; t < num_threads; t++) {
+    for (int d = 0; d < num_instrs[t]; d++) {
+      for (int i = 0; i < d; i++) {
+	if (Model::ordered(program[t][i], program[t][d])) {
+	  po[t][d] |= (InstrMask)1 << i;
+	}
+      }
+    }
+  }
+  // With a projection the skipped instructions run first, so the
+  // graph is closed transitively: the other instructions still wait
+  // for what the skipped ones waited for
+  if (!projected) return;
+  for (int t = 0; t < num_threads; t++) {
+    for (int d = 0; d < num_instrs[t]; d++) {
+      for (int i = 0; i < d; i++) {
+	if ((po[t][d] >> i) & 1) po[t][d] |= po[t][i];
+      }
     }
   }
-  memvars[num_memvars] = var;
-  memvalues[num_memvars] = 0;
-  num_memvars++;
 }
 
-int get_memvar(string var) {
-  for (int pos = 0; pos < num_memvars; pos++) {
-    if (memvars[pos].compare(var) == 0) {
-      return memvalues[pos];
-    }
+// The store-atomic variant of the relaxed model
+void CheckerContext::build_po_graph_ibm() {
+  if (options->model == RELAXED_PSO) {
+    build_po_graph<StoreAtomic<PSO> >();
+  } else if (options->model == RELAXED_ARM) {
+    build_po_graph<StoreAtomic<ARMLite> >();
+  } else {
+    build_po_graph<IBM370>();
   }
-  assert(false);
 }
 
-int update_memvar(string var, int value) {
-  for (int pos = 0; pos < num_memvars; pos++) {
-    if (memvars[pos].compare(var) == 0) {
-      int aux = memvalues[pos];
-      memvalues[pos] = value;
-      return aux;
-    }
+void CheckerContext::build_po_graph_tso() {
+  if (options->model == RELAXED_PSO) {
+    build_po_graph<PSO>();
+  } else if (options->model == RELAXED_ARM) {
+    build_po_graph<ARMLite>();
+  } else {
+    build_po_graph<TSO>();
   }
-  assert(false);
 }
 
-int update_load(int thread, int instr, int value) {
-  int aux = loadvalues[thread][instr];
-  loadvalues[thread][instr] = value;
-  return aux;
+void CheckerContext::build_po_graph_both() {
+  build_po_graph_ibm();
+  memcpy(po_ibm, po, sizeof(po));
+  build_po_graph_tso();
 }
 
-void print_mem(ostream& out) {
-  for (int pos = 0; pos < num_memvars; pos++) {
-    out << "[" << memvars[pos] << "]==" << memvalues[pos] << "; ";
-  }
+
+// Executed
+// All the instructions of thread t
+InstrMask CheckerContext::thread_mask(int t) {
+  if (num_instrs[t] == 64) return ~(InstrMask)0;
+  return ((InstrMask)1 << num_instrs[t]) - 1;
 }
 
-void print_loads(ostream& out) {
+void CheckerContext::reset_executed() {
+  num_pending = 0;
   for (int t = 0; t < num_threads; t++) {
-    for (int i = 0; i < num_instrs[t]; i++) {
-      if (!program[t][i].store) {
-	//out << program[t][i].mem << "_" << t+1 << "_" << i+1 << "==" << loadvalues[t][i] << "; ";
-     	out << program[t][i].mem << "==" << loadvalues[t][i] << "; ";
-      }
-    }
+    pending[t] = thread_mask(t);
+    num_pending += num_instrs[t];
+    issued[t] = 0;
   }
+  ibm_path = false;
 }
 
-// Solutions
-set<string> solutions_ibm;
-set<string> solutions_tso;
-
-void add_possible_execution_ibm() {
-  stringstream ss;
-  print_mem(ss);
-  print_loads(ss);
-  solutions_ibm.insert(ss.str());
+bool CheckerContext::is_executed(int t, int i) {
+  return !((pending[t] >> i) & 1);
 }
 
-void add_possible_execution_tso() {
-  stringstream ss;
-  print_mem(ss);
-  print_loads(ss);
-  solutions_tso.insert(ss.str());
+void CheckerContext::set_executed(int t, int i) {
+  pending[t] &= ~((InstrMask)1 << i);
+  num_pending--;
 }
 
-// Given a program order, get all possible executions
-void get_possible_executions_ibm() {
-  for (int t = 0; t < num_threads; t++) {
-    for (int i = 0; i < num_instrs[t]; i++) {
-      if (!executed[t][i] && !has_po_dependencies(t, i)) {
-	
-	// execute instruction
-	executed[t][i] = true;
-	int old_val;
-	if (program[t][i].store) {
-	  old_val = update_memvar(program[t][i].mem, program[t][i].value);
-	} else {
-	  old_val = update_load(t, i, get_memvar(program[t][i].mem)); // IBM370
-	}
-
-	// remove dependencies
-	remove_po(t, i);
+void CheckerContext::unset_executed(int t, int i) {
+  pending[t] |= (InstrMask)1 << i;
+  num_pending++;
+}
 
-	// Check end or recursive
-	if (all_executed()) {
-	  add_possible_execution_ibm();
-	} else {
-	  get_possible_executions_ibm();
-	}
-	
-	// reverse
-	add_po_ibm(t, i);
+bool CheckerContext::has_po_dependencies(int thread, int instr) {
+  return (pending[thread] & po[thread][instr]) != 0;
+}
 
-	if (program[t][i].store) {
-	  update_memvar(program[t][i].mem, old_val);
-	} else {
-	  update_load(t, i, 0);
-	}
-	executed[t][i] = false;
-      }
-    }
-  }
+bool CheckerContext::all_executed() {
+  return num_pending == 0;
 }
 
-bool is_prevstore(int thread, int instr) {
+bool CheckerContext::is_prevstore(int thread, int instr) {
   assert(!program[thread][instr].store);
   for (int i = instr - 1; i >= 0; i--) {
     if (program[thread][i].store
-	&& program[thread][i].mem.compare(program[thread][instr].mem) == 0) {
+	&& program[thread][i].mem == program[thread][instr].mem) {
       return true;
     }
   }
   return false;
 }
 
-bool is_prevstore_executed(int thread, int instr) {
+bool CheckerContext::is_prevstore_executed(int thread, int instr) {
   assert(!program[thread][instr].store);
   for (int i = instr - 1; i >= 0; i--) {
     if (program[thread][i].store
-	&& program[thread][i].mem.compare(program[thread][instr].mem) == 0) {
-      if (executed[thread][i]) {
+	&& program[thread][i].mem == program[thread][instr].mem) {
+      if (is_executed(thread, i)) {
 	return true;
       }
     }
@@ -267,169 +631,3543 @@ bool is_prevstore_executed(int thread, int instr) {
   return false;
 }
 
-int get_prevstore(int thread, int instr) {
+int CheckerContext::get_prevstore(int thread, int instr) {
   assert(!program[thread][instr].store);
   for (int i = instr - 1; i >= 0; i--) {
     if (program[thread][i].store
-	&& program[thread][i].mem.compare(program[thread][instr].mem) == 0) {
+	&& program[thread][i].mem == program[thread][instr].mem) {
       return program[thread][i].value;
     }
   }
   assert(false);
 }
 
-// Given a program order, get all possible executions
-void get_possible_executions_tso() {
+
+// Store buffers
+void CheckerContext::build_store_buffers() {
   for (int t = 0; t < num_threads; t++) {
+    store_mask[t] = 0;
     for (int i = 0; i < num_instrs[t]; i++) {
-      if (!executed[t][i] && !has_po_dependencies(t, i)) {
-	
-	// execute instruction
-	executed[t][i] = true;
+      if (program[t][i].store) {
+	store_mask[t] |= (InstrMask)1 << i;
+	prev_store[t][i] = -1;
+      } else {
+	int d = i - 1;
+	while (d >= 0 && !(program[t][d].store
+			   && program[t][d].mem == program[t][i].mem)) {
+	  d--;
+	}
+	prev_store[t][i] = d;
+      }
+    }
+  }
+}
 
-	// remove dependencies
-	remove_po(t, i);
+// Stores of thread t that have issued and not drained, the oldest
+// in the lowest bit
+InstrMask CheckerContext::buffered(int t) {
+  InstrMask issued_mask = issued[t] == 64 ? ~(InstrMask)0
+    : ((InstrMask)1 << issued[t]) - 1;
+  return pending[t] & store_mask[t] & issued_mask;
+}
 
-	int old_val = get_memvar(program[t][i].mem);
-	if (program[t][i].store) {
-	  update_memvar(program[t][i].mem, program[t][i].value);
-	} else {
-	  if (is_prevstore(t, i) && !is_prevstore_executed(t, i)) {
-	    update_load(t, i, get_prevstore(t, i)); // TSO
-	  } else {
-	    update_load(t, i, get_memvar(program[t][i].mem)); // IBM370
-	  }
-	}
 
-	// Check end or recursive
-	if (all_executed()) {
-	  add_possible_execution_tso();
-	} else {
-	  get_possible_executions_tso();
-	}
+// Memory and loaded values
+const char* CheckerContext::memvar(int var) const {
+  return var_names.data() + name_start[var];
+}
 
-	if (!program[t][i].store && is_prevstore(t, i) && !is_prevstore_executed(t, i)) {
-	  update_load(t, i, get_prevstore(t, i)); // TSO
-	  // Check end or recursive
-	  if (all_executed()) {
-	    add_possible_execution_tso();
-	  } else {
-	    get_possible_executions_tso();
-	  }
-	}
+// Variables are interned at parse time; returns the ID of var
+int CheckerContext::insert_memvar(const char* var, size_t len) {
+  for (int pos = 0; pos < num_memvars; pos++) {
+    const char* name = memvar(pos);
+    if (strncmp(name, var, len) == 0 && name[len] == '\0') {
+      return pos;
+    }
+  }
+  name_start[num_memvars] = var_names.size();
+  var_names.append(var, len);
+  var_names.push_back('\0');
+  memvalues[num_memvars] = 0;
+  return num_memvars++;
+}
 
-	// reverse
-	if (program[t][i].store) {
-	  update_memvar(program[t][i].mem, old_val);
-	} else {
-	  update_load(t, i, 0);
-	}
-	add_po_tso(t, i);
-	executed[t][i] = false;
+int CheckerContext::get_memvar(int var) {
+  assert(var < num_memvars);
+  return memvalues[var];
+}
+
+int CheckerContext::update_memvar(int var, int value) {
+  assert(var < num_memvars);
+  int aux = memvalues[var];
+  memvalues[var] = value;
+  return aux;
+}
+
+int CheckerContext::update_load(int thread, int instr, int value) {
+  int aux = loadvalues[thread][instr];
+  loadvalues[thread][instr] = value;
+  return aux;
+}
+
+
+// Solutions
+void CheckerContext::gather_outcome() {
+  leaf.clear();
+  for (int var = 0; var < num_memvars; var++) {
+    if (!projected || project_var[var]) leaf.push_back(memvalues[var]);
+  }
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (projected ? (project_loads[t] >> i) & 1 : !program[t][i].store) {
+	leaf.push_back(loadvalues[t][i]);
       }
     }
   }
 }
 
-void print_instr(Instr i) {
-  if (i.store) {
-    cout << "st " << i.mem << ", " << i.value;   
-  } else {
-    cout << "ld " << i.mem;
+void CheckerContext::print_mem(ostream& out, const Outcome& o) {
+  int pos = 0;
+  for (int var = 0; var < num_memvars; var++) {
+    if (!projected || project_var[var]) {
+      out << "[" << memvar(var) << "]==" << o[pos++] << "; ";
+    }
   }
 }
-  
-void print_program() {
-  for (int i = 0; i < max_instrs; i++) {
-    for (int t = 0; t < num_threads; t++) {
-      if (i < num_instrs[t]) {
-	print_instr(program[t][i]);
-	cout << "\t\t";
-      } else {
-	cout << "\t\t\t";
+
+void CheckerContext::print_loads(ostream& out, const Outcome& o) {
+  int pos = 0;
+  for (int var = 0; var < num_memvars; var++) {
+    pos += !projected || project_var[var];
+  }
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (projected ? (project_loads[t] >> i) & 1 : !program[t][i].store) {
+	//out << memvar(program[t][i].mem) << "_" << t+1 << "_" << i+1 << "==" << o[pos] << "; ";
+     	out << memvar(program[t][i].mem) << "==" << o[pos++] << "; ";
       }
     }
-    cout << endl;
   }
 }
 
-int main (int argc, char *argv[]) {  
-  string line;
-  int num_thread = 0;
-  int num_instr = 0;
-  do {
-    getline(cin, line);
-    stringstream ss;
-    ss.str(line);
-    //cout << line << endl;
-    Instr i;
-    string op;
-    ss >> op;
-    if (op.compare("---") == 0) {
-      num_instrs[num_thread] = num_instr;
-      if (num_instr > max_instrs) {
-	max_instrs = num_instr;
-      }
-      num_thread++;
-      assert(num_thread < MAX_THREADS);
-      num_instr = 0;
-    } else if (op.compare("st") == 0) {
-      i.store = true;
-      ss >> i.mem;
-      ss >> i.value;
-      //cout << num_thread << " " << num_instr << " "; print_instr(i); cout << endl;
-      program[num_thread][num_instr] = i;
-      num_instr++;
-      insert_memvar(i.mem);
-    } else if (op.compare("ld") == 0) { 
-      i.store = false;
-      ss >> i.mem;
-      //cout << num_thread << " " << num_instr << " "; print_instr(i); cout << endl;
-      program[num_thread][num_instr] = i;
-      num_instr++;
-      assert(num_instr < MAX_INSTRUCTIONS);
-      insert_memvar(i.mem);
-      loadvalues[num_thread][num_instr] = 0;
-    } else if (op.compare("") == 0) { 
-    } else {
-      cout << op << endl;
-      assert(false);
+string CheckerContext::format_outcome(const Outcome& o) {
+  stringstream ss;
+  print_mem(ss, o);
+  print_loads(ss, o);
+  return ss.str();
+}
+
+SortedSolutions CheckerContext::sort_solutions(const Solutions& sols) {
+  SortedSolutions sorted;
+  sorted.reserve(sols.size());
+  for (auto it = sols.begin(); it != sols.end(); it++) {
+    sorted.push_back(make_pair(format_outcome(*it), &*it));
+  }
+  sort(sorted.begin(), sorted.end());
+  return sorted;
+}
+
+// For each TSO solution, whether it breaks store atomicity, that
+// is, it is not an IBM370 solution. Both lists are in the same
+// order, so a single merge pass classifies them.
+vector<bool> CheckerContext::breaks_store_atomicity(const SortedSolutions& sorted_ibm,
+						    const SortedSolutions& sorted_tso) {
+  vector<bool> breaks(sorted_tso.size());
+  size_t k = 0;
+  for (size_t pos = 0; pos < sorted_tso.size(); pos++) {
+    while (k < sorted_ibm.size() && sorted_ibm[k].first < sorted_tso[pos].first) {
+      k++;
     }
-  } while(!cin.eof());
-  num_threads = num_thread;
-  cout << "PROGRAM LOADED:" << endl;
-  print_program();
-  cout << endl;
-  
-  reset_executed();  
-  solutions_ibm.clear();
-  build_po_graph_ibm();
-  get_possible_executions_ibm();
-  cout << "IBM370 (STORE-ATOMIC) POSSIBLE SOLUTIONS:" << endl;
-  for (auto it = solutions_ibm.begin(); it != solutions_ibm.end(); it++) {
-    cout << *it << endl;
+    breaks[pos] = k == sorted_ibm.size() || sorted_ibm[k].first != sorted_tso[pos].first;
   }
-  cout << endl;
+  return breaks;
+}
+
+void CheckerContext::print_solutions(ostream& out) {
+  out << store_atomic_name() << " (STORE-ATOMIC) POSSIBLE SOLUTIONS:" << endl;
+  SortedSolutions sorted_ibm = sort_solutions(solutions_ibm);
+  for (auto it = sorted_ibm.begin(); it != sorted_ibm.end(); it++) {
+    out << it->first << endl;
+  }
+  out << endl;
   
-  reset_executed();  
-  solutions_tso.clear();
-  build_po_graph_tso();
-  get_possible_executions_tso();
-  cout << "TSO (WRITE-ATOMIC) POSSIBLE SOLUTIONS (* breaks store atomicity):" << endl;
+  out << relaxed_name() << " (WRITE-ATOMIC) POSSIBLE SOLUTIONS (* breaks store atomicity):" << endl;
+  SortedSolutions sorted_tso = sort_solutions(solutions_tso);
+  vector<bool> breaks = breaks_store_atomicity(sorted_ibm, sorted_tso);
+  size_t num_breaks = 0;
+  for (size_t pos = 0; pos < sorted_tso.size(); pos++) {
+    out << sorted_tso[pos].first;
+    if (breaks[pos]) {
+      out << "*";
+      num_breaks++;
+    }
+    out << endl;
+  }
+  out << endl;
+
+  out << "STORE ATOMICITY VIOLATIONS: " << num_breaks << " of "
+      << sorted_tso.size() << " " << relaxed_name() << " solutions ("
+      << sorted_ibm.size() << " " << store_atomic_name() << " solutions)" << endl;
+  for (size_t pos = 0; pos < sorted_tso.size(); pos++) {
+    if (breaks[pos]) {
+      out << sorted_tso[pos].first << endl;
+    }
+  }
+  out << endl;
+}
+
+// Sampling only finds part of the solutions. The share of the
+// executions whose outcome was found is estimated from those reached
+// by a single walk (Good-Turing), and the number of solutions from
+// those reached once and twice (Chao1).
+void CheckerContext::print_coverage(ostream& out) {
+  out << "SAMPLED: " << num_walks << " random executions" << endl;
+  for (int model = 0; model < 2; model++) {
+    long long walks = 0, once = 0, twice = 0;
+    for (auto it = sample_counts[model].begin(); it != sample_counts[model].end(); it++) {
+      walks += it->second;
+      once += it->second == 1;
+      twice += it->second == 2;
+    }
+    double found = sample_counts[model].size();
+    double total = found + (twice > 0 ? once * once / (2.0 * twice)
+			    : once * (once - 1) / 2.0);
+    double coverage = walks > 0 ? 100.0 * (walks - once) / walks : 0;
+    out << (model == 0 ? store_atomic_name() : relaxed_name()) << ": "
+	<< (long long)found << " outcomes in " << walks << " executions, "
+	<< (int)(coverage * 10) / 10.0 << "% coverage, about "
+	<< (long long)(total + 0.5) << " outcomes in all" << endl;
+  }
+  out << endl;
+}
+
+// Binary results (-f bin), made of 32-bit words in host byte order so
+// that they can be mapped and read in place:
+//   header   "CCR1", num_vars, num_loads, num_rows, names_size
+//   names    the variable names, NUL-terminated, padded to a word
+//   loads    thread, instruction and variable of each load
+//   rows     flags, then the final value of each variable and the
+//            value of each load (the order of the text output)
+// There is a row per outcome of either model, in ascending order of
+// its values. Several results can follow one another.
+#define ROW_IBM 1
+#define ROW_TSO 2
+#define ROW_BREAKS 4 // a TSO outcome that is not IBM370
+
+void write_word(ostream& out, uint32_t word) {
+  out.write((const char*)&word, sizeof(word));
+}
+
+void CheckerContext::write_results(ostream& out) {
+  vector<pair<const Outcome*, uint32_t> > rows;
   for (auto it = solutions_tso.begin(); it != solutions_tso.end(); it++) {
-    cout << *it;
-    bool found = false;
-    for (auto it2 = solutions_ibm.begin(); it2 != solutions_ibm.end(); it2++) {
-      if ((*it).compare(*it2) == 0) {
-	found = true;
-      }
+    rows.push_back(make_pair(&*it, solutions_ibm.count(*it)
+			     ? ROW_IBM | ROW_TSO : ROW_TSO | ROW_BREAKS));
+  }
+  for (auto it = solutions_ibm.begin(); it != solutions_ibm.end(); it++) {
+    if (!solutions_tso.count(*it)) {
+      rows.push_back(make_pair(&*it, (uint32_t)ROW_IBM));
     }
-    if (!found) {
-      cout << "*";
+  }
+  sort(rows.begin(), rows.end(),
+       [](const pair<const Outcome*, uint32_t>& a, const pair<const Outcome*, uint32_t>& b) {
+	 return *a.first < *b.first;
+       });
+
+  string names;
+  for (int pos = 0; pos < num_memvars; pos++) {
+    names += memvar(pos);
+    names += '\0';
+  }
+  names.resize((names.size() + 3) / 4 * 4, '\0');
+  int num_loads = 0;
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      num_loads += !program[t][i].store;
     }
-    cout << endl;
   }
-  cout << endl;
+
+  out.write("CCR1", 4);
+  write_word(out, num_memvars);
+  write_word(out, num_loads);
+  write_word(out, rows.size());
+  write_word(out, names.size());
+  out.write(names.data(), names.size());
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (!program[t][i].store) {
+	write_word(out, t);
+	write_word(out, i);
+	write_word(out, program[t][i].mem);
+      }
+    }
+  }
+  for (size_t pos = 0; pos < rows.size(); pos++) {
+    write_word(out, rows[pos].second);
+    out.write((const char*)rows[pos].first->data(), rows[pos].first->size() * sizeof(int));
+  }
+}
+
+uint32_t read_word(istream& in) {
+  uint32_t word = 0;
+  in.read((char*)&word, sizeof(word));
+  return word;
+}
+
+// Writes a file through writer to the temporary file tmp and renames
+// it to path, so that a crash never leaves a partial file at path.
+// False, with nothing written, if it fails.
+bool write_aside(const string& path, const string& tmp,
+		 const function<void(ostream&)>& writer) {
+  ofstream out(tmp, ios::binary);
+  writer(out);
+  out.close();
+  error_code ec;
+  if (out) filesystem::rename(tmp, path, ec);
+  if (!out || ec) {
+    filesystem::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+// Reads back results written by write_results for this same program:
+// false if they are not, or are cut short
+bool CheckerContext::read_results(istream& in) {
+  char magic[4];
+  in.read(magic, 4);
+  uint32_t vars = read_word(in), loads = read_word(in);
+  uint32_t rows = read_word(in), names_size = read_word(in);
+  if (!in || memcmp(magic, "CCR1", 4) != 0 || (int)vars != num_memvars) {
+    return false;
+  }
+  string names(names_size, '\0');
+  in.read(&names[0], names_size);
+  size_t pos = 0;
+  for (int v = 0; v < num_memvars; v++) {
+    size_t len = strlen(memvar(v)) + 1;
+    if (names.compare(pos, len, memvar(v), len) != 0) {
+      return false;
+    }
+    pos += len;
+  }
+  uint32_t num_loads = 0;
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (!program[t][i].store) {
+	num_loads++;
+	if (read_word(in) != (uint32_t)t || read_word(in) != (uint32_t)i
+	    || read_word(in) != (uint32_t)program[t][i].mem) {
+	  return false;
+	}
+      }
+    }
+  }
+  if (!in || num_loads != loads) {
+    return false;
+  }
+  solutions_ibm.clear();
+  solutions_tso.clear();
+  Outcome o(vars + loads);
+  for (uint32_t r = 0; r < rows; r++) {
+    uint32_t flags = read_word(in);
+    in.read((char*)o.data(), o.size() * sizeof(int));
+    if (flags & ROW_IBM) solutions_ibm.insert(o);
+    if (flags & ROW_TSO) solutions_tso.insert(o);
+  }
+  return (bool)in;
+}
+
+// Streaming output: every solution is passed to a sink (printed, with
+// -u) as soon as it is found, and kept packed to drop duplicates, so
+// nothing is formatted or sorted. Shared by all the workers of a
+// search.
+struct SolutionStream {
+  mutex lock;
+  OutcomeSink sink;
+  OutcomeRows seen_ibm;
+  OutcomeRows seen_tso;
+
+  SolutionStream(const OutcomeSink& s) : sink(s) {}
+
+  void add(const Outcome& o, bool ibm, bool tso) {
+    lock_guard<mutex> guard(lock);
+    if (ibm && seen_ibm.insert(o)) sink(false, o.data(), o.size());
+    if (tso && seen_tso.insert(o)) sink(true, o.data(), o.size());
+  }
+};
+
+// Streams an outcome of the models ibm and tso, unless this context
+// already streamed it lately
+void CheckerContext::stream_outcome(const Outcome& o, bool ibm, bool tso) {
+  int models = recent.add(o, (ibm ? 1 : 0) | (tso ? 2 : 0));
+  if (models != 0) stream->add(o, (models & 1) != 0, (models & 2) != 0);
+}
+
+// Adds an outcome of the models ibm and tso
+void CheckerContext::record_outcome(const Outcome& o, bool ibm, bool tso) {
+  if (symmetric) {
+    add_symmetric_outcomes(o, ibm, tso);
+    return;
+  }
+  if (stream) {
+    stream_outcome(o, ibm, tso);
+    return;
+  }
+  if (ibm) solutions_ibm.insert(o);
+  if (tso) solutions_tso.insert(o);
+}
+
+void CheckerContext::add_possible_execution_ibm() {
+  num_leaves++;
+  gather_outcome();
+  record_outcome(leaf, true, false);
+}
+
+void CheckerContext::add_possible_execution_tso() {
+  num_leaves++;
+  gather_outcome();
+  record_outcome(leaf, false, true);
+}
+
+void CheckerContext::add_possible_execution_both() {
+  num_leaves++;
+  gather_outcome();
+  record_outcome(leaf, ibm_path, true);
+}
+
+
+// Symmetry reduction
+// Threads are identical if they have the same instructions. The
+// reduction is not used with sleep sets, whose slots would have to be
+// permuted too, nor in query mode, whose target tells threads apart,
+// nor with a projection, which drops a different part of each thread.
+// Programs with more than MAX_RENAMINGS renamings only use the
+// permutations of identical threads.
+#define MAX_RENAMINGS 120
+
+void CheckerContext::build_symmetry() {
+  symmetric = false;
+  symmetry_classes.clear();
+  renamings.clear();
+  int pos = num_memvars;
+  for (int t = 0; t < num_threads; t++) {
+    load_offset[t] = pos;
+    for (int i = 0; i < num_instrs[t]; i++) {
+      pos += !program[t][i].store;
+    }
+  }
+  if (!options->symmetry || options->por || has_target || projected) return;
+  vector<int> first_identical(num_threads, -1);
+  vector<int> identity(num_memvars);
+  for (int v = 0; v < num_memvars; v++) {
+    identity[v] = v;
+  }
+  for (int t1 = 0; t1 < num_threads; t1++) {
+    if (first_identical[t1] >= 0) continue;
+    first_identical[t1] = t1;
+    vector<int> members(1, t1);
+    for (int t2 = t1 + 1; t2 < num_threads; t2++) {
+      vector<int> var = identity, inv = identity;
+      if (first_identical[t2] < 0 && map_thread(t1, t2, var, inv)) {
+	members.push_back(t2);
+	first_identical[t2] = t1;
+      }
+    }
+    if (members.size() > 1) {
+      symmetry_classes.push_back(members);
+    }
+  }
+  vector<int> image(num_threads);
+  vector<bool> used(num_threads, false);
+  find_renamings(0, image, used, first_identical, vector<int>(num_memvars, -1),
+		 vector<int>(num_memvars, -1));
+  if (renamings.size() > MAX_RENAMINGS) {
+    renamings.clear();
+  }
+  symmetric = !symmetry_classes.empty() || !renamings.empty();
+}
+
+// Whether thread t becomes thread u when its variables are renamed by
+// var, whose inverse is inv (-1 for the variables not renamed yet);
+// the variables not renamed yet are renamed as needed
+bool CheckerContext::map_thread(int t, int u, vector<int>& var, vector<int>& inv) {
+  if (num_instrs[t] != num_instrs[u]) return false;
+  for (int i = 0; i < num_instrs[t]; i++) {
+    const Instr& a = program[t][i];
+    const Instr& b = program[u][i];
+    if (a.store != b.store || (a.store && a.value != b.value)) return false;
+    if (var[a.mem] < 0 && inv[b.mem] < 0) {
+      var[a.mem] = b.mem;
+      inv[b.mem] = a.mem;
+    } else if (var[a.mem] != b.mem) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Maps threads t and up onto the threads not used yet, and adds an
+// automorphism for every renaming of the variables found. Identical
+// threads can take each other's place, so only the first unused
+// thread of a class is tried.
+void CheckerContext::find_renamings(int t, vector<int>& image, vector<bool>& used,
+				    const vector<int>& first_identical,
+				    const vector<int>& var, const vector<int>& inv) {
+  if (renamings.size() > MAX_RENAMINGS) return;
+  if (t == num_threads) {
+    Renaming r;
+    r.from_thread.resize(num_threads);
+    r.from_var.resize(num_memvars);
+    bool renamed = false;
+    for (int k = 0; k < num_threads; k++) {
+      r.from_thread[image[k]] = k;
+    }
+    for (int v = 0; v < num_memvars; v++) {
+      r.from_var[var[v]] = v;
+      renamed = renamed || var[v] != v;
+    }
+    for (size_t k = 0; renamed && k < renamings.size(); k++) {
+      renamed = renamings[k].from_var != r.from_var;
+    }
+    if (renamed) renamings.push_back(r);
+    return;
+  }
+  for (int u = 0; u < num_threads; u++) {
+    bool first = !used[u];
+    for (int w = 0; first && w < u; w++) {
+      first = used[w] || first_identical[w] != first_identical[u];
+    }
+    vector<int> next_var = var, next_inv = inv;
+    if (!first || !map_thread(t, u, next_var, next_inv)) continue;
+    used[u] = true;
+    image[t] = u;
+    find_renamings(t + 1, image, used, first_identical, next_var, next_inv);
+    used[u] = false;
+  }
+}
+
+// Compares the state of two identical threads: whether the state of
+// t1 is lower than that of t2 if less, or equal otherwise
+bool CheckerContext::same_thread_state(int t1, int t2, bool less) {
+  if (pending[t1] != pending[t2]) {
+    return less && pending[t1] < pending[t2];
+  }
+  for (int i = 0; i < num_instrs[t1]; i++) {
+    if (loadvalues[t1][i] != loadvalues[t2][i]) {
+      return less && loadvalues[t1][i] < loadvalues[t2][i];
+    }
+  }
+  if (issued[t1] != issued[t2]) {
+    return less && issued[t1] < issued[t2];
+  }
+  return !less;
+}
+
+// Adds the images of o under every automorphism: for each renaming
+// (the first one keeps the variables), under every permutation of
+// the threads of each class
+void CheckerContext::add_symmetric_outcomes(const Outcome& o, bool ibm, bool tso) {
+  Outcome renamed(o.size()), image;
+  for (size_t r = 0; r <= renamings.size(); r++) {
+    if (r == 0) {
+      renamed = o;
+    } else {
+      const Renaming& renaming = renamings[r - 1];
+      for (int v = 0; v < num_memvars; v++) {
+	renamed[v] = o[renaming.from_var[v]];
+      }
+      for (int t = 0; t < num_threads; t++) {
+	int from = renaming.from_thread[t];
+	int num_loads = (from + 1 < num_threads ? load_offset[from + 1] : (int)o.size())
+	  - load_offset[from];
+	copy(o.begin() + load_offset[from], o.begin() + load_offset[from] + num_loads,
+	     renamed.begin() + load_offset[t]);
+      }
+    }
+    add_permuted_outcomes(renamed, ibm, tso, image);
+  }
+}
+
+// Adds o and its images under every permutation of the threads of
+// each class; image is a scratch outcome
+void CheckerContext::add_permuted_outcomes(const Outcome& o, bool ibm, bool tso,
+					   Outcome& image) {
+  vector<vector<int> > order = symmetry_classes;
+  for (;;) {
+    image = o;
+    for (size_t k = 0; k < order.size(); k++) {
+      const vector<int>& members = symmetry_classes[k];
+      int num_loads = (members[0] + 1 < num_threads ? load_offset[members[0] + 1]
+		       : (int)o.size()) - load_offset[members[0]];
+      for (size_t pos = 0; pos < members.size(); pos++) {
+	copy(o.begin() + load_offset[order[k][pos]],
+	     o.begin() + load_offset[order[k][pos]] + num_loads,
+	     image.begin() + load_offset[members[pos]]);
+      }
+    }
+    if (stream) {
+      stream_outcome(image, ibm, tso);
+    } else {
+      if (ibm) solutions_ibm.insert(image);
+      if (tso) solutions_tso.insert(image);
+    }
+    // Next permutation, the last class changing fastest
+    size_t k = order.size();
+    while (k > 0 && !next_permutation(order[k-1].begin(), order[k-1].end())) {
+      k--;
+    }
+    if (k == 0) break;
+  }
+}
+
+
+// Query mode
+// Reads a target outcome in the format of the solutions, such as
+// "x==1; y==0; [x]==2". The k-th "x==" term fixes the value read by
+// the k-th load of x in thread order; variables and loads that are
+// not mentioned can take any value. The query is asked about the
+// models QUERY_* of models.
+bool CheckerContext::parse_target(const string& cond, int models, string& error) {
+  has_target = true;
+  query_models = models;
+  int num_terms[MAX_SLOTS] = {0};
+  stringstream ss(cond);
+  string term;
+  while (getline(ss, term, ';')) {
+    term.erase(remove_if(term.begin(), term.end(), ::isspace), term.end());
+    if (term.empty()) continue;
+    size_t eq = term.find("==");
+    if (eq == string::npos || eq == 0 || eq + 2 == term.size()) {
+      error = "malformed query term " + term;
+      return false;
+    }
+    string var = term.substr(0, eq);
+    char* end;
+    long value = strtol(term.c_str() + eq + 2, &end, 10);
+    if (*end != '\0') {
+      error = "malformed query term " + term;
+      return false;
+    }
+    bool mem = var[0] == '[' && var[var.size() - 1] == ']';
+    if (mem) {
+      var = var.substr(1, var.size() - 2);
+    }
+    int id = 0;
+    while (id < num_memvars && var != memvar(id)) id++;
+    if (id == num_memvars) {
+      error = "unknown variable " + var + " in query";
+      return false;
+    }
+    if (mem) {
+      if (find(target_vars.begin(), target_vars.end(), id) != target_vars.end()) {
+	error = "[" + var + "] fixed twice in query";
+	return false;
+      }
+      target_vars.push_back(id);
+      target_values.push_back(value);
+      for (int t = 0; t < MAX_THREADS; t++) {
+	InstrMask stores = 0, matching = 0;
+	for (int i = 0; i < num_instrs[t]; i++) {
+	  if (program[t][i].store && program[t][i].mem == id) {
+	    stores |= (InstrMask)1 << i;
+	    if (program[t][i].value == value) {
+	      matching |= (InstrMask)1 << i;
+	    }
+	  }
+	}
+	target_stores.push_back(stores);
+	target_matching.push_back(matching);
+      }
+      continue;
+    }
+    // Find the load this term refers to
+    int k = num_terms[id]++;
+    bool found = false;
+    for (int t = 0; t < num_threads && !found; t++) {
+      for (int i = 0; i < num_instrs[t] && !found; i++) {
+	if (!program[t][i].store && program[t][i].mem == id && k-- == 0) {
+	  target_loads[t] |= (InstrMask)1 << i;
+	  target_load[t][i] = value;
+	  found = true;
+	}
+      }
+    }
+    if (!found) {
+      error = "more " + var + " terms in query than loads of " + var;
+      return false;
+    }
+  }
+  return true;
+}
+
+// False if no execution from the current state has the target
+// outcome: an executed load read another value, or the final value
+// of a variable can no longer be the target one. The final value is
+// the current one if all stores to the variable have executed, and
+// the value of one of the pending stores otherwise.
+bool CheckerContext::may_reach_target() {
+  for (int t = 0; t < num_threads; t++) {
+    InstrMask loads = target_loads[t] & ~pending[t];
+    for (int i = 0; loads != 0; i++, loads >>= 1) {
+      if ((loads & 1) && loadvalues[t][i] != target_load[t][i]) {
+	return false;
+      }
+    }
+  }
+  for (size_t k = 0; k < target_vars.size(); k++) {
+    InstrMask stores = 0, matching = 0;
+    for (int t = 0; t < num_threads; t++) {
+      stores |= pending[t] & target_stores[k*MAX_THREADS + t];
+      matching |= pending[t] & target_matching[k*MAX_THREADS + t];
+    }
+    if (stores != 0 ? matching == 0
+	: memvalues[target_vars[k]] != target_values[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only outcomes with the target are recorded in query mode, so a
+// model allows the target if it has any solution
+void CheckerContext::print_query(ostream& out, const string& query) {
+  out << "QUERY: " << query << endl;
+  if (query_models & QUERY_IBM) {
+    out << store_atomic_name() << " (STORE-ATOMIC): ";
+    if (solutions_ibm.empty()) {
+      out << "forbidden" << endl;
+    } else {
+      out << "allowed, e.g. " << sort_solutions(solutions_ibm)[0].first << endl;
+    }
+  }
+  if (query_models & QUERY_TSO) {
+    out << relaxed_name() << " (WRITE-ATOMIC): ";
+    if (solutions_tso.empty()) {
+      out << "forbidden" << endl;
+    } else {
+      out << "allowed, e.g. " << sort_solutions(solutions_tso)[0].first << endl;
+    }
+  }
+  out << endl;
+}
+
+
+// Projection
+// Reads the terms of the outcome that are of interest, in the format
+// of the solutions without values, such as "x; [y]". As in a query,
+// the k-th "x" term is the k-th load of x in thread order.
+// Loads have no effect other than their value, so the loads that are
+// not projected are skipped, and so are the stores to the variables
+// whose final value and loads are not projected either.
+bool CheckerContext::parse_projection(const string& terms, string& error) {
+  projected = true;
+  int num_terms[MAX_SLOTS] = {0};
+  bool relevant[MAX_SLOTS] = {false};
+  bool empty = true;
+  stringstream ss(terms);
+  string term;
+  while (getline(ss, term, ';')) {
+    term.erase(remove_if(term.begin(), term.end(), ::isspace), term.end());
+    if (term.empty()) continue;
+    empty = false;
+    string var = term;
+    bool mem = var[0] == '[' && var[var.size() - 1] == ']';
+    if (mem) {
+      var = var.substr(1, var.size() - 2);
+    }
+    int id = 0;
+    while (id < num_memvars && var != memvar(id)) id++;
+    if (id == num_memvars) {
+      error = "unknown variable " + var + " in projection";
+      return false;
+    }
+    relevant[id] = true;
+    if (mem) {
+      project_var[id] = true;
+      continue;
+    }
+    int k = num_terms[id]++;
+    bool found = false;
+    for (int t = 0; t < num_threads && !found; t++) {
+      for (int i = 0; i < num_instrs[t] && !found; i++) {
+	if (!program[t][i].store && program[t][i].mem == id && k-- == 0) {
+	  project_loads[t] |= (InstrMask)1 << i;
+	  found = true;
+	}
+      }
+    }
+    if (!found) {
+      error = "more " + var + " terms in projection than loads of " + var;
+      return false;
+    }
+  }
+  if (empty) {
+    error = "empty projection";
+    return false;
+  }
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (program[t][i].store ? !relevant[program[t][i].mem]
+	  : !((project_loads[t] >> i) & 1)) {
+	skipped[t] |= (InstrMask)1 << i;
+      }
+    }
+  }
+  return true;
+}
+
+// Runs the skipped instructions before a search starts (see
+// build_po_graph for the order of the others)
+void CheckerContext::skip_unprojected() {
+  if (!projected) return;
+  for (int t = 0; t < num_threads; t++) {
+    pending[t] &= ~skipped[t];
+    num_pending -= bitset<64>(skipped[t]).count();
+  }
+}
+
+
+// Partial-order reduction
+void CheckerContext::build_slots() {
+  num_slots = 0;
+  for (int t = 0; t < num_threads; t++) {
+    first_slot[t] = num_slots;
+    for (int i = 0; i < num_instrs[t]; i++) {
+      slot_thread[num_slots] = t;
+      slot_instr[num_slots] = i;
+      num_slots++;
+    }
+  }
+}
+
+// Sets of slots are a single word when the program has at most 64
+// instructions and a bitset otherwise; the search is instantiated
+// for the narrowest set that fits (see with_slot_set())
+inline bool has_slot(uint64_t set, int n) {
+  return (set >> n) & 1;
+}
+
+inline void add_slot(uint64_t& set, int n) {
+  set |= (uint64_t)1 << n;
+}
+
+template <size_t N>
+inline bool has_slot(const bitset<N>& set, int n) {
+  return set[n];
+}
+
+template <size_t N>
+inline void add_slot(bitset<N>& set, int n) {
+  set.set(n);
+}
+
+// Instructions of the same thread are always dependent: they are
+// ordered by po and, under TSO, a load forwarding from a previous
+// store (is_prevstore) depends on whether that store has executed.
+// Across threads only accesses to the same variable with at least
+// one store conflict, forwarding loads included.
+bool CheckerContext::are_independent(int t1, int i1, int t2, int i2) {
+  if (t1 == t2) return false;
+  if (program[t1][i1].mem != program[t2][i2].mem) return true;
+  return !program[t1][i1].store && !program[t2][i2].store;
+}
+
+// Sleep set of the state reached by executing (t, i)
+template <typename SlotSet>
+SlotSet CheckerContext::next_sleep(const SlotSet& sleep, int t, int i) {
+  SlotSet next = SlotSet();
+  for (int n = 0; n < num_slots; n++) {
+    if (has_slot(sleep, n)
+	&& are_independent(slot_thread[n], slot_instr[n], t, i)) {
+      add_slot(next, n);
+    }
+  }
+  return next;
+}
+
+
+// Compact encoding of the state: pending bits packed in thread
+// order, memory values, load values and the combined search flag.
+// Two paths reaching the same encoding have the same set of
+// reachable outcomes.
+// With symmetry reduction, the state is encoded as the least of its
+// images under the renamings, including the one that keeps the
+// variables.
+string CheckerContext::encode_state() {
+  string key = encode_image(NULL);
+  for (size_t r = 0; symmetric && r < renamings.size(); r++) {
+    string image = encode_image(&renamings[r]);
+    if (image < key) key.swap(image);
+  }
+  return key;
+}
+
+// Encoding of the image of the state under the renaming r, if any.
+// With symmetry reduction, the threads of each class are encoded in
+// the order of their state, thread src[t] in place of thread t.
+string CheckerContext::encode_image(const Renaming* r) {
+  int src[MAX_THREADS];
+  for (int t = 0; t < num_threads; t++) {
+    src[t] = r ? r->from_thread[t] : t;
+  }
+  for (size_t k = 0; symmetric && k < symmetry_classes.size(); k++) {
+    const vector<int>& members = symmetry_classes[k];
+    vector<int> sorted;
+    for (size_t pos = 0; pos < members.size(); pos++) {
+      sorted.push_back(src[members[pos]]);
+    }
+    sort(sorted.begin(), sorted.end(), [this](int t1, int t2) {
+	return same_thread_state(t1, t2, true);
+      });
+    for (size_t pos = 0; pos < sorted.size(); pos++) {
+      src[members[pos]] = sorted[pos];
+    }
+  }
+  int num_words = (num_slots + 63) / 64;
+  uint64_t words[MAX_SLOTS / 64];
+  for (int w = 0; w < num_words; w++) {
+    words[w] = 0;
+  }
+  for (int t = 0; t < num_threads; t++) {
+    int w = first_slot[t] / 64;
+    int b = first_slot[t] % 64;
+    words[w] |= pending[src[t]] << b;
+    if (b > 0 && b + num_instrs[t] > 64) {
+      words[w+1] |= pending[src[t]] >> (64 - b);
+    }
+  }
+  string key((const char*)words, num_words * sizeof(uint64_t));
+  if (r) {
+    for (int v = 0; v < num_memvars; v++) {
+      key.append((const char*)&memvalues[r->from_var[v]], sizeof(int));
+    }
+  } else {
+    key.append((const char*)memvalues, num_memvars * sizeof(int));
+  }
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (!program[t][i].store) {
+	key.append((const char*)&loadvalues[src[t]][i], sizeof(int));
+      }
+    }
+  }
+  if (options->store_buffers) {
+    for (int t = 0; t < num_threads; t++) {
+      key.push_back(issued[src[t]]);
+    }
+  }
+  key.push_back(ibm_path);
+  return key;
+}
+
+// Inverse of encode_state, up to an automorphism
+void CheckerContext::decode_state(const string& key) {
+  int num_words = (num_slots + 63) / 64;
+  uint64_t words[MAX_SLOTS / 64];
+  memcpy(words, key.data(), num_words * sizeof(uint64_t));
+  num_pending = 0;
+  for (int t = 0; t < num_threads; t++) {
+    int w = first_slot[t] / 64;
+    int b = first_slot[t] % 64;
+    InstrMask mask = words[w] >> b;
+    if (b > 0 && w + 1 < num_words) {
+      mask |= words[w+1] << (64 - b);
+    }
+    pending[t] = mask & thread_mask(t);
+    num_pending += bitset<64>(pending[t]).count();
+  }
+  size_t pos = num_words * sizeof(uint64_t);
+  memcpy(memvalues, key.data() + pos, num_memvars * sizeof(int));
+  pos += num_memvars * sizeof(int);
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      if (!program[t][i].store) {
+	memcpy(&loadvalues[t][i], key.data() + pos, sizeof(int));
+	pos += sizeof(int);
+      }
+    }
+  }
+  if (options->store_buffers) {
+    for (int t = 0; t < num_threads; t++) {
+      issued[t] = key[pos++];
+    }
+  }
+  ibm_path = key[pos];
+}
+
+
+// Search over the executions of a test, specialized for SlotSet sets
+// of instructions. The visited states and the task queues are shared
+// by all the workers of a search.
+
+// Visited states, with the sleep set they were explored with. The
+// cache is split in shards so that parallel workers can share it.
+#define VISITED_SHARDS 64
+
+template <typename SlotSet>
+struct VisitedShard {
+  mutex lock;
+  unordered_map<string, SlotSet> states;
+};
+
+// Parallel exploration: the first split_depth levels of the tree
+// are not recursed into but pushed as tasks, each carrying the
+// encoded search state, to the queue of the worker that generated
+// them. Workers take their newest task and steal the oldest one (the
+// largest subtree) of another worker when they run out.
+template <typename SlotSet>
+struct Task {
+  string state;
+  SlotSet sleep;
+};
+
+template <typename SlotSet>
+struct TaskQueue {
+  mutex lock;
+  deque<Task<SlotSet> > tasks;
+};
+
+#ifdef STATS
+// Counters of a search, shared by its workers. Calls and expanded
+// states are counted per depth (executed instructions), with the
+// number of instructions that could run at each expanded state, so
+// the size of the whole tree can be estimated while it is explored.
+struct SearchStats {
+  atomic<long long> calls;
+  atomic<long long> leaves;
+  atomic<long long> duplicates; // leaves with an already known outcome
+  atomic<long long> forwards;   // loads that read a previous store
+  atomic<long long> depth_calls[MAX_SLOTS + 1];
+  atomic<long long> depth_nodes[MAX_SLOTS + 1];
+  atomic<long long> depth_children[MAX_SLOTS + 1];
+  mutex progress_lock;
+  chrono::steady_clock::time_point last_progress;
+
+  SearchStats() : calls(0), leaves(0), duplicates(0), forwards(0),
+		  last_progress(chrono::steady_clock::now()) {
+    for (int d = 0; d <= MAX_SLOTS; d++) {
+      depth_calls[d] = 0;
+      depth_nodes[d] = 0;
+      depth_children[d] = 0;
+    }
+  }
+
+  long long num_nodes(int depth) {
+    long long n = 0;
+    for (int d = 0; d <= depth; d++) {
+      n += depth_nodes[d];
+    }
+    return n;
+  }
+
+  // Expanded states expected at each depth: those of the previous
+  // depth, times their average fan-out, times the share of calls that
+  // were not pruned
+  double estimate(int depth) {
+    double level = 1, total = 1;
+    for (int d = 0; d < depth && depth_nodes[d] > 0 && depth_calls[d+1] > 0; d++) {
+      level *= (double)depth_children[d] / depth_nodes[d]
+	* depth_nodes[d+1] / depth_calls[d+1];
+      total += level;
+    }
+    return total;
+  }
+
+  void progress(ostream& log, int depth) {
+    unique_lock<mutex> guard(progress_lock, try_to_lock);
+    if (!guard) return;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now - last_progress < chrono::seconds(1)) return;
+    last_progress = now;
+    long long n = num_nodes(depth);
+    double total = max(estimate(depth), (double)n);
+    log << "progress: " << n << " states expanded, ~" << (long long)total
+	<< " estimated (" << (int)(1000.0 * n / total) / 10.0 << "%)" << endl;
+  }
+
+  void print(ostream& log, const char* name, int depth) {
+    log << name << ": " << calls << " calls, " << leaves << " leaves ("
+	<< duplicates << " duplicates), " << forwards << " forwarded loads" << endl;
+    log << name << ": fan-out per depth:";
+    for (int d = 0; d < depth && depth_nodes[d] > 0; d++) {
+      log << " " << (double)depth_children[d] / depth_nodes[d];
+    }
+    log << endl;
+  }
+};
+#endif
+
+template <typename SlotSet>
+struct SharedSearch {
+  VisitedShard<SlotSet> visited[VISITED_SHARDS];
+  atomic<long long> num_pruned;
+  int num_jobs;
+  vector<TaskQueue<SlotSet> > queues;
+  atomic<long> num_outstanding; // tasks queued or running
+  atomic<long> num_queued;
+  mutex idle_lock;              // idle workers wait on task_ready for
+  condition_variable task_ready; // a task, or for the search to end
+  int split_depth;
+  mutex merge_lock;
+#ifdef STATS
+  SearchStats stats;
+#endif
+  atomic<bool> found_ibm; // query mode: the target has been found
+  atomic<bool> found_tso;
+  size_t num_expanded;    // states of the levels the frontier engine left
+  atomic<long long> walk_tickets; // random executions started
+  chrono::steady_clock::time_point deadline;
+
+  SharedSearch(int jobs) : num_pruned(0), num_jobs(jobs),
+			   num_outstanding(0), num_queued(0), split_depth(0),
+			   found_ibm(false), found_tso(false), num_expanded(0),
+			   walk_tickets(0) {}
+
+  size_t num_visited() {
+    size_t n = num_expanded;
+    for (int s = 0; s < VISITED_SHARDS; s++) {
+      n += visited[s].states.size();
+    }
+    return n;
+  }
+};
+
+// Models of the engines
+#define MODEL_IBM 0
+#define MODEL_TSO 1
+#define MODEL_BOTH 2 // combined search
+#define MODEL_SB 3   // TSO with explicit store buffers
+
+template <typename SlotSet>
+struct Search : CheckerContext {
+  typedef void (Search::*Engine)(SlotSet sleep);
+
+  SharedSearch<SlotSet>* shared;
+  int worker_id;
+
+  // Checkpoints: the search is the phase-th of search(), and resumed
+  // if its frames and trail were read from a checkpoint
+  int phase;
+  bool resumed;
+  long long num_steps;
+  chrono::steady_clock::time_point next_checkpoint;
+
+  Search(const CheckerContext& c, SharedSearch<SlotSet>* s)
+    : CheckerContext(c), shared(s), worker_id(0), phase(0), resumed(false),
+      num_steps(0) {
+    next_checkpoint = chrono::steady_clock::now()
+      + chrono::duration_cast<chrono::steady_clock::duration>
+      (chrono::duration<double>(options->checkpoint_interval));
+  }
+
+  bool explored_as_ibm_path(string key, const SlotSet& sleep);
+  SlotSet visit_state(SlotSet& sleep);
+  bool split_here();
+  void push_task(const SlotSet& sleep);
+  bool pop_task(Task<SlotSet>& task);
+  void copy_workers(vector<unique_ptr<Search> >& copies);
+  void merge_worker(Search& worker);
+  void run_worker(Engine engine, Search* main);
+  void explore(Engine engine);
+#ifdef STATS
+  void count_call();
+  void count_node();
+  void count_leaf(const Solutions& sols);
+#endif
+  bool answered(int models);
+  void add_possible_execution_ibm();
+  void add_possible_execution_tso();
+  void add_possible_execution_both();
+
+  void get_possible_executions_ibm(SlotSet sleep);
+  void get_possible_executions_tso(SlotSet sleep);
+  void get_possible_executions_both(SlotSet sleep);
+  void get_possible_executions_sb(SlotSet sleep);
+
+  struct Frame {
+    SlotSet sleep;
+    SlotSet todo;
+    int action;
+    int branch;
+    bool active;   // the action is running, with its undo on the trail
+    bool ibm_path;
+  };
+
+  struct Undo {
+    int thread;
+    int instr;
+    int old_val;
+  };
+
+  vector<Frame> frames;
+  vector<Undo> trail;
+
+  template <int M> void walk(SlotSet sleep);
+  template <int M> void enter(SlotSet sleep);
+  template <int M> bool enabled(const Frame& f);
+  template <int M> void run(const Frame& f);
+  template <int M> void undo(const Frame& f);
+  template <int M> void add_leaf();
+  template <int M> bool may_answer();
+
+  // Frontier engine
+  typedef vector<VisitedShard<SlotSet> > Level; // VISITED_SHARDS shards
+  template <int M> void breadth_first(SlotSet sleep);
+  template <int M> void expand(const Level& level, const string& key,
+			       const SlotSet& sleep, Level& next);
+  void add_to_level(Level& next, const SlotSet& sleep);
+
+  // Sampling
+  template <int M> void sample();
+  template <int M> void random_walks();
+
+  // Checkpoints
+  void write_checkpoint();
+  bool read_checkpoint(const string& path);
+};
+
+// Combined search: the TSO outcomes reachable from a state are
+// already recorded if it was explored as part of an IBM370 path
+// with a subset of the sleep set
+template <typename SlotSet>
+bool Search<SlotSet>::explored_as_ibm_path(string key, const SlotSet& sleep) {
+  key[key.size() - 1] = true;
+  VisitedShard<SlotSet>& shard =
+    shared->visited[hash<string>()(key) % VISITED_SHARDS];
+  unique_lock<mutex> guard(shard.lock, defer_lock);
+  if (shared->num_jobs > 1) guard.lock();
+  auto it = shard.states.find(key);
+  return it != shard.states.end() && (it->second & ~sleep) == SlotSet();
+}
+
+// Returns the instructions still to be explored from the current
+// state, or none if it was already explored. A revisited state only
+// explores the instructions that were asleep the previous time, and
+// its sleep set becomes the intersection of both.
+template <typename SlotSet>
+SlotSet Search<SlotSet>::visit_state(SlotSet& sleep) {
+  string key = encode_state();
+  if (options->combined && !ibm_path && explored_as_ibm_path(key, sleep)) {
+    shared->num_pruned++;
+    return SlotSet();
+  }
+  VisitedShard<SlotSet>& shard =
+    shared->visited[hash<string>()(key) % VISITED_SHARDS];
+  unique_lock<mutex> guard(shard.lock, defer_lock);
+  if (shared->num_jobs > 1) guard.lock();
+  auto res = shard.states.insert(make_pair(key, sleep));
+  if (res.second) {
+    return ~SlotSet();
+  }
+  SlotSet awake = res.first->second & ~sleep;
+  if (awake == SlotSet()) {
+    shared->num_pruned++;
+    return SlotSet();
+  }
+  sleep &= res.first->second;
+  res.first->second = sleep;
+  return awake;
+}
+
+template <typename SlotSet>
+bool Search<SlotSet>::split_here() {
+  return shared->num_jobs > 1
+    && num_slots - num_pending <= shared->split_depth;
+}
+
+template <typename SlotSet>
+void Search<SlotSet>::push_task(const SlotSet& sleep) {
+  Task<SlotSet> task;
+  task.state = encode_state();
+  task.sleep = sleep;
+  shared->num_outstanding++;
+  TaskQueue<SlotSet>& queue = shared->queues[worker_id];
+  {
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks.push_back(task);
+  }
+  shared->num_queued++;
+  // Taking the lock orders the task before the check of a worker
+  // about to wait, so that the worker either sees it or is woken
+  lock_guard<mutex> guard(shared->idle_lock);
+  shared->task_ready.notify_one();
+}
+
+template <typename SlotSet>
+bool Search<SlotSet>::pop_task(Task<SlotSet>& task) {
+  int num_queues = shared->num_jobs;
+  for (int k = 0; k < num_queues; k++) {
+    TaskQueue<SlotSet>& queue = shared->queues[(worker_id + k) % num_queues];
+    lock_guard<mutex> guard(queue.lock);
+    if (!queue.tasks.empty()) {
+      if (k == 0) {
+	task = queue.tasks.back();
+	queue.tasks.pop_back();
+      } else {
+	task = queue.tasks.front();
+	queue.tasks.pop_front();
+      }
+      shared->num_queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+// A private copy of the search for each of the num_jobs workers
+template <typename SlotSet>
+void Search<SlotSet>::copy_workers(vector<unique_ptr<Search> >& copies) {
+  for (int id = 0; id < shared->num_jobs; id++) {
+    copies.push_back(unique_ptr<Search>(new Search(*this)));
+    copies[id]->worker_id = id;
+  }
+}
+
+// Adds the solutions and counts of a worker to the search
+template <typename SlotSet>
+void Search<SlotSet>::merge_worker(Search& worker) {
+  solutions_ibm.insert(worker.solutions_ibm.begin(), worker.solutions_ibm.end());
+  solutions_tso.insert(worker.solutions_tso.begin(), worker.solutions_tso.end());
+  num_leaves += worker.num_leaves;
+  num_walks += worker.num_walks;
+  for (int model = 0; model < 2; model++) {
+    for (auto it = worker.sample_counts[model].begin(); it != worker.sample_counts[model].end(); it++) {
+      sample_counts[model][it->first] += it->second;
+    }
+  }
+}
+
+// Runs on a private copy of the search, and merges its solutions
+// into the main one when there are no tasks left. A worker without a
+// task sleeps until one is queued or the last one has run.
+template <typename SlotSet>
+void Search<SlotSet>::run_worker(Engine engine, Search* main) {
+  Task<SlotSet> task;
+  for (;;) {
+    if (pop_task(task)) {
+      decode_state(task.state);
+      (this->*engine)(task.sleep);
+      if (--shared->num_outstanding == 0) {
+	lock_guard<mutex> guard(shared->idle_lock);
+	shared->task_ready.notify_all();
+      }
+      continue;
+    }
+    unique_lock<mutex> guard(shared->idle_lock);
+    shared->task_ready.wait(guard, [this]() {
+	return shared->num_outstanding == 0 || shared->num_queued > 0;
+      });
+    if (shared->num_outstanding == 0) break;
+  }
+  lock_guard<mutex> guard(shared->merge_lock);
+  main->merge_worker(*this);
+}
+
+// Explore the whole tree from the current state, with num_jobs
+// workers if more than one was requested
+template <typename SlotSet>
+void Search<SlotSet>::explore(Engine engine) {
+  int jobs = shared->num_jobs;
+  if (jobs == 1 || options->frontier || options->sampling()) {
+    (this->*engine)(SlotSet());
+    return;
+  }
+  // Split until there are enough tasks to keep every worker busy,
+  // counting from the depth of the current state
+  long width = 1;
+  shared->split_depth = num_slots - num_pending;
+  while (width < 16L * jobs && shared->split_depth < num_slots) {
+    width *= num_threads;
+    shared->split_depth++;
+  }
+  shared->queues = vector<TaskQueue<SlotSet> >(jobs);
+  push_task(SlotSet());
+  vector<unique_ptr<Search> > copies;
+  copy_workers(copies);
+  vector<thread> workers;
+  for (int id = 0; id < jobs; id++) {
+    workers.push_back(thread(&Search::run_worker, copies[id].get(),
+			     engine, this));
+  }
+  for (int id = 0; id < jobs; id++) {
+    workers[id].join();
+  }
+}
+
+// Query mode: true once the target has been found for all the given
+// models, so that their search can stop
+template <typename SlotSet>
+bool Search<SlotSet>::answered(int models) {
+  return ((models & QUERY_IBM) == 0 || shared->found_ibm)
+    && ((models & QUERY_TSO) == 0 || shared->found_tso);
+}
+
+// Leaves of the search. In query mode only the outcomes with the
+// target are recorded.
+template <typename SlotSet>
+void Search<SlotSet>::add_possible_execution_ibm() {
+  if (has_target && !may_reach_target()) return;
+  STAT(count_leaf(solutions_ibm));
+  CheckerContext::add_possible_execution_ibm();
+  if (has_target) shared->found_ibm = true;
+}
+
+template <typename SlotSet>
+void Search<SlotSet>::add_possible_execution_tso() {
+  if (has_target && !may_reach_target()) return;
+  STAT(count_leaf(solutions_tso));
+  CheckerContext::add_possible_execution_tso();
+  if (has_target) shared->found_tso = true;
+}
+
+template <typename SlotSet>
+void Search<SlotSet>::add_possible_execution_both() {
+  if (has_target && !may_reach_target()) return;
+  STAT(count_leaf(solutions_tso));
+  CheckerContext::add_possible_execution_both();
+  if (has_target) {
+    if (ibm_path) shared->found_ibm = true;
+    shared->found_tso = true;
+  }
+}
+
+#ifdef STATS
+template <typename SlotSet>
+void Search<SlotSet>::count_call() {
+  int depth = num_slots - num_pending;
+  shared->stats.depth_calls[depth]++;
+  if ((++shared->stats.calls & 0xffff) == 0 && log) {
+    shared->stats.progress(*log, num_slots);
+  }
+}
+
+template <typename SlotSet>
+void Search<SlotSet>::count_leaf(const Solutions& sols) {
+  shared->stats.leaves++;
+  gather_outcome();
+  if (!stream && sols.count(leaf) > 0) {
+    shared->stats.duplicates++;
+  }
+}
+
+// An expanded state, with the instructions that could run from it
+template <typename SlotSet>
+void Search<SlotSet>::count_node() {
+  int depth = num_slots - num_pending;
+  int children = 0;
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_instrs[t]; i++) {
+      children += !is_executed(t, i) && !has_po_dependencies(t, i);
+    }
+  }
+  shared->stats.depth_nodes[depth]++;
+  shared->stats.depth_children[depth] += children;
+}
+#endif
+
+// The engines walk the tree of executions iteratively. Every level
+// of the walk is a Frame with the state it was entered with and the
+// next action to try; the action it is exploring has an Undo record
+// on the trail, so going back up restores the parent state without
+// re-deriving it. In the models on instructions, action n is
+// instruction n and TSO has a second branch for loads that forward;
+// with store buffers, action 2t drains the buffer of thread t and
+// action 2t+1 issues its next instruction.
+
+// Given a program order, get all possible executions
+template <typename SlotSet>
+void Search<SlotSet>::get_possible_executions_ibm(SlotSet sleep) {
+  walk<MODEL_IBM>(sleep);
+}
+
+// Given a program order, get all possible executions
+template <typename SlotSet>
+void Search<SlotSet>::get_possible_executions_tso(SlotSet sleep) {
+  walk<MODEL_TSO>(sleep);
+}
+
+// Combined search: walks the TSO tree once. TSO only relaxes the
+// order of a load after a store to the same variable, so a path is
+// also an IBM370 execution as long as every instruction respected
+// po_ibm; on such a path no load forwards and TSO loads read the
+// same values as IBM370 loads. Leaves of IBM370 paths are added to
+// both solution sets. In query mode, once TSO is answered only IBM370
+// paths are followed. The same holds for every relaxed model and its
+// store-atomic variant.
+template <typename SlotSet>
+void Search<SlotSet>::get_possible_executions_both(SlotSet sleep) {
+  walk<MODEL_BOTH>(sleep);
+}
+
+// TSO with explicit store buffers: at every state a thread can
+// either issue its next instruction or drain the oldest store of its
+// buffer. A load reads the youngest buffered store to its variable,
+// if any, and memory otherwise. Stores only issue while the buffer
+// has less than buffer_depth stores, so a bounded depth explores a
+// subset of the TSO executions. Sleep sets are not used.
+template <typename SlotSet>
+void Search<SlotSet>::get_possible_executions_sb(SlotSet sleep) {
+  walk<MODEL_SB>(sleep);
+}
+
+// Pushes a frame for the current state, unless the query is answered
+// or the state needs no exploring
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::enter(SlotSet sleep) {
+  STAT(count_call());
+  if (!may_answer<M>()) return;
+  SlotSet todo = visit_state(sleep);
+  if (todo == SlotSet()) return;
+  STAT(count_node());
+  Frame f;
+  f.sleep = sleep;
+  f.todo = todo;
+  f.action = 0;
+  f.branch = 0;
+  f.active = false;
+  f.ibm_path = ibm_path;
+  frames.push_back(f);
+}
+
+// False in query mode if the answer cannot change from the current
+// state: the queried models are answered or the target is out of reach
+template <typename SlotSet>
+template <int M>
+bool Search<SlotSet>::may_answer() {
+  if (!has_target) return true;
+  int models = M == MODEL_IBM ? QUERY_IBM : QUERY_TSO;
+  if (M == MODEL_BOTH && ibm_path) models = query_models;
+  return !answered(models & query_models) && may_reach_target();
+}
+
+// Whether the current action of f can run
+template <typename SlotSet>
+template <int M>
+bool Search<SlotSet>::enabled(const Frame& f) {
+  if (M == MODEL_SB) {
+    int t = f.action / 2;
+    if (f.action % 2 == 0) {
+      return buffered(t) != 0;
+    }
+    if (issued[t] == num_instrs[t]) {
+      return false;
+    }
+    return !program[t][issued[t]].store || options->buffer_depth == 0
+      || (int)bitset<64>(buffered(t)).count() < options->buffer_depth;
+  }
+  int t = slot_thread[f.action];
+  int i = slot_instr[f.action];
+  if (f.branch == 1) { // TSO: the load also forwards
+    return !program[t][i].store && is_prevstore(t, i) && !is_prevstore_executed(t, i);
+  }
+  return !is_executed(t, i) && !has_po_dependencies(t, i)
+    && has_slot(f.todo, f.action) && !has_slot(f.sleep, f.action);
+}
+
+// Runs the current action of f and records how to undo it
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::run(const Frame& f) {
+  Undo u;
+  if (M == MODEL_SB) {
+    int t = f.action / 2;
+    u.thread = t;
+    if (f.action % 2 == 0) { // drain the oldest buffered store
+      InstrMask buffer = buffered(t);
+      int i = 0;
+      while ((buffer & ((InstrMask)1 << i)) == 0) i++;
+      set_executed(t, i);
+      u.instr = i;
+      u.old_val = update_memvar(program[t][i].mem, program[t][i].value);
+    } else { // issue the next instruction
+      int i = issued[t]++;
+      u.instr = i;
+      if (!program[t][i].store) {
+	set_executed(t, i);
+	int s = prev_store[t][i];
+	if (s >= 0 && !is_executed(t, s)) {
+	  update_load(t, i, program[t][s].value); // forwarded
+	  STAT(shared->stats.forwards++);
+	} else {
+	  update_load(t, i, get_memvar(program[t][i].mem));
+	}
+      }
+    }
+    trail.push_back(u);
+    return;
+  }
+  int t = slot_thread[f.action];
+  int i = slot_instr[f.action];
+  u.thread = t;
+  u.instr = i;
+  if (M == MODEL_BOTH) {
+    ibm_path = f.ibm_path && (pending[t] & po_ibm[t][i]) == 0;
+  }
+  set_executed(t, i);
+  u.old_val = get_memvar(program[t][i].mem);
+  if (program[t][i].store) {
+    update_memvar(program[t][i].mem, program[t][i].value);
+  } else if (M == MODEL_IBM) {
+    update_load(t, i, get_memvar(program[t][i].mem)); // IBM370
+  } else if (f.branch == 1
+	     || (is_prevstore(t, i) && !is_prevstore_executed(t, i))) {
+    update_load(t, i, get_prevstore(t, i)); // TSO
+    STAT(shared->stats.forwards++);
+  } else {
+    update_load(t, i, get_memvar(program[t][i].mem)); // IBM370
+  }
+  trail.push_back(u);
+}
+
+// Reverses the last action of the trail
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::undo(const Frame& f) {
+  Undo u = trail.back();
+  trail.pop_back();
+  int t = u.thread;
+  int i = u.instr;
+  if (M == MODEL_SB && f.action % 2 == 1) {
+    issued[t]--;
+    if (program[t][i].store) return;
+  }
+  if (program[t][i].store) {
+    update_memvar(program[t][i].mem, u.old_val);
+  } else {
+    update_load(t, i, 0);
+  }
+  unset_executed(t, i);
+  ibm_path = f.ibm_path;
+}
+
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::add_leaf() {
+  if (M == MODEL_IBM) {
+    add_possible_execution_ibm();
+  } else if (M == MODEL_BOTH) {
+    add_possible_execution_both();
+  } else {
+    add_possible_execution_tso();
+  }
+}
+
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::walk(SlotSet sleep) {
+  size_t base = 0;
+  if (resumed) { // the frames come from a checkpoint
+    resumed = false;
+  } else {
+    if (all_executed()) { // a projection skipped every instruction
+      add_leaf<M>();
+      return;
+    }
+    if (options->frontier) {
+      breadth_first<M>(sleep);
+      return;
+    }
+    if (options->sampling()) {
+      sample<M>();
+      return;
+    }
+    base = frames.size();
+    enter<M>(sleep);
+  }
+  int num_actions = M == MODEL_SB ? 2 * num_threads : num_slots;
+  while (frames.size() > base) {
+    if (!options->checkpoint_path.empty() && (++num_steps & 0xfff) == 0
+	&& chrono::steady_clock::now() >= next_checkpoint) {
+      write_checkpoint();
+    }
+    Frame& f = frames.back();
+    if (f.active) {
+      // Back from the current action: try its next branch, if any
+      f.active = false;
+      undo<M>(f);
+      if (M == MODEL_TSO && f.branch == 0) {
+	f.branch = 1;
+	if (enabled<M>(f)) continue;
+      }
+      if (options->por && M != MODEL_SB) add_slot(f.sleep, f.action);
+      f.action++;
+      f.branch = 0;
+      continue;
+    }
+    if (f.action == num_actions) {
+      ibm_path = f.ibm_path;
+      frames.pop_back();
+      continue;
+    }
+    if (!enabled<M>(f)) {
+      f.action++;
+      continue;
+    }
+
+    // execute the action
+    run<M>(f);
+    f.active = true;
+    SlotSet next = SlotSet();
+    if (options->por && M != MODEL_SB) {
+      next = next_sleep(f.sleep, slot_thread[f.action], slot_instr[f.action]);
+    }
+
+    // Check end or go down
+    if (all_executed()) {
+      add_leaf<M>();
+    } else if (split_here()) {
+      push_task(next);
+    } else {
+      enter<M>(next);
+    }
+  }
+}
+
+// Checkpoints (--checkpoint FILE): every checkpoint_interval seconds,
+// the depth-first search writes its frames, trail and current state,
+// the visited states and the solutions found so far to FILE, so that
+// --resume can go on from there. The frames are written as they are in
+// memory, with some words of header:
+//   "CCK1", the size of a slot set, the phase, the key (2 words)
+//   num_frames, the frames, the trail size, the trail
+//   the current state: pending, memory, loads, issued, ibm_path
+//   num_pruned and num_leaves (2 words each), the number of visited
+//   states, then for each its size, its key and its sleep set
+//   the solutions, as "-f bin" results
+// The key is a hash of the program and the options that change the
+// search, and a checkpoint is only read back with the same key.
+uint64_t checkpoint_key(const CheckerContext& c);
+
+template <typename SlotSet>
+void Search<SlotSet>::write_checkpoint() {
+  const string& path = options->checkpoint_path;
+  // A single search writes the checkpoint, so the temporary file has a
+  // fixed name: a kill while writing leaves it to the next checkpoint
+  // to overwrite, and the end of the search to remove
+  bool written = write_aside(path, path + ".tmp", [this](ostream& out) {
+      uint64_t key = checkpoint_key(*this);
+      out.write("CCK1", 4);
+      write_word(out, sizeof(SlotSet));
+      write_word(out, phase);
+      out.write((const char*)&key, sizeof(key));
+      write_word(out, frames.size());
+      out.write((const char*)frames.data(), frames.size() * sizeof(Frame));
+      write_word(out, trail.size());
+      out.write((const char*)trail.data(), trail.size() * sizeof(Undo));
+      out.write((const char*)pending, num_threads * sizeof(InstrMask));
+      out.write((const char*)memvalues, num_memvars * sizeof(int));
+      for (int t = 0; t < num_threads; t++) {
+	out.write((const char*)loadvalues[t], num_instrs[t] * sizeof(int));
+      }
+      out.write((const char*)issued, num_threads * sizeof(int));
+      write_word(out, ibm_path);
+      long long counts[2] = {shared->num_pruned, num_leaves};
+      out.write((const char*)counts, sizeof(counts));
+      write_word(out, shared->num_visited());
+      for (int s = 0; s < VISITED_SHARDS; s++) {
+	for (auto it = shared->visited[s].states.begin(); it != shared->visited[s].states.end(); it++) {
+	  write_word(out, it->first.size());
+	  out.write(it->first.data(), it->first.size());
+	  out.write((const char*)&it->second, sizeof(SlotSet));
+	}
+      }
+      write_results(out);
+    });
+  if (!written) {
+    cerr << path << ": cannot write checkpoint" << endl;
+  } else if (log) {
+    *log << "checkpoint: " << frames.size() << " frames, "
+	 << shared->num_visited() << " states written to " << path << endl;
+  }
+  next_checkpoint = chrono::steady_clock::now()
+    + chrono::duration_cast<chrono::steady_clock::duration>
+    (chrono::duration<double>(options->checkpoint_interval));
+}
+
+// The phase saved in the checkpoint at path, or -1 if there is none
+// for this program, these options or sets of this size
+template <typename SlotSet>
+int checkpoint_phase(const CheckerContext& c, const string& path) {
+  ifstream in(path, ios::binary);
+  char magic[4];
+  uint64_t key = 0;
+  in.read(magic, 4);
+  uint32_t size = read_word(in), phase = read_word(in);
+  in.read((char*)&key, sizeof(key));
+  if (!in || memcmp(magic, "CCK1", 4) != 0 || size != sizeof(SlotSet)
+      || key != checkpoint_key(c)) {
+    return -1;
+  }
+  return phase;
+}
+
+template <typename SlotSet>
+bool Search<SlotSet>::read_checkpoint(const string& path) {
+  ifstream in(path, ios::binary);
+  in.seekg(4 + 2 * sizeof(uint32_t) + sizeof(uint64_t));
+  frames.resize(read_word(in));
+  in.read((char*)frames.data(), frames.size() * sizeof(Frame));
+  trail.resize(read_word(in));
+  in.read((char*)trail.data(), trail.size() * sizeof(Undo));
+  in.read((char*)pending, num_threads * sizeof(InstrMask));
+  in.read((char*)memvalues, num_memvars * sizeof(int));
+  for (int t = 0; t < num_threads; t++) {
+    in.read((char*)loadvalues[t], num_instrs[t] * sizeof(int));
+  }
+  in.read((char*)issued, num_threads * sizeof(int));
+  ibm_path = read_word(in);
+  num_pending = 0;
+  for (int t = 0; t < num_threads; t++) {
+    num_pending += bitset<64>(pending[t]).count();
+  }
+  long long counts[2];
+  in.read((char*)counts, sizeof(counts));
+  shared->num_pruned = counts[0];
+  num_leaves = counts[1];
+  uint32_t num_states = read_word(in);
+  string key;
+  SlotSet sleep;
+  for (uint32_t k = 0; k < num_states && in; k++) {
+    key.resize(read_word(in));
+    in.read(&key[0], key.size());
+    in.read((char*)&sleep, sizeof(SlotSet));
+    shared->visited[hash<string>()(key) % VISITED_SHARDS].states[key] = sleep;
+  }
+  resumed = in && read_results(in);
+  return resumed;
+}
+
+// Frontier engine (-F): the tree is explored a level at a time
+// instead of depth first. Every state of a level has run the same
+// number of instructions, so deduplicating each level visits every
+// state once, and only two levels are kept instead of every visited
+// state. A state reached with several sleep sets is expanded once with
+// their intersection. The states of a level are expanded by num_jobs
+// workers, each with its own copy of the search, into the sharded
+// table of the next level.
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::breadth_first(SlotSet sleep) {
+  Level level(VISITED_SHARDS), next(VISITED_SHARDS);
+  add_to_level(level, sleep);
+  int jobs = shared->num_jobs;
+  vector<unique_ptr<Search> > copies;
+  copy_workers(copies);
+  for (;;) {
+    vector<const pair<const string, SlotSet>*> states;
+    for (int k = 0; k < VISITED_SHARDS; k++) {
+      for (auto it = level[k].states.begin(); it != level[k].states.end(); it++) {
+	states.push_back(&*it);
+      }
+    }
+    if (states.empty()) break;
+    atomic<size_t> next_state(0);
+    auto expand_level = [&](Search* search) {
+      for (size_t k = next_state++; k < states.size(); k = next_state++) {
+	search->template expand<M>(level, states[k]->first, states[k]->second, next);
+      }
+    };
+    if (jobs == 1) {
+      expand_level(copies[0].get());
+    } else {
+      vector<thread> workers;
+      for (int id = 0; id < jobs; id++) {
+	workers.push_back(thread(expand_level, copies[id].get()));
+      }
+      for (int id = 0; id < jobs; id++) {
+	workers[id].join();
+      }
+    }
+    shared->num_expanded += states.size();
+    for (int k = 0; k < VISITED_SHARDS; k++) {
+      level[k].states.clear();
+    }
+    level.swap(next);
+  }
+  for (int id = 0; id < jobs; id++) {
+    merge_worker(*copies[id]);
+  }
+}
+
+// Runs every action that can run from a state of the level, and adds
+// the states reached to the next one. As in visit_state, a state off
+// an IBM370 path is left out if the level has it on one.
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::expand(const Level& level, const string& key,
+			     const SlotSet& sleep, Level& next) {
+  decode_state(key);
+  if (!may_answer<M>()) return;
+  if (options->combined && !ibm_path) {
+    string ibm_key = key;
+    ibm_key[ibm_key.size() - 1] = true;
+    const VisitedShard<SlotSet>& shard = level[hash<string>()(ibm_key) % VISITED_SHARDS];
+    auto it = shard.states.find(ibm_key);
+    if (it != shard.states.end() && (it->second & ~sleep) == SlotSet()) {
+      shared->num_pruned++;
+      return;
+    }
+  }
+  STAT(count_node());
+  Frame f;
+  f.sleep = sleep;
+  f.todo = ~SlotSet();
+  f.active = false;
+  f.ibm_path = ibm_path;
+  int num_actions = M == MODEL_SB ? 2 * num_threads : num_slots;
+  for (f.action = 0; f.action < num_actions; f.action++) {
+    f.branch = 0;
+    if (!enabled<M>(f)) continue;
+    for (;;) {
+      run<M>(f);
+      if (all_executed()) {
+	add_leaf<M>();
+      } else {
+	STAT(count_call());
+	SlotSet next_sleep_set = SlotSet();
+	if (options->por && M != MODEL_SB) {
+	  next_sleep_set = next_sleep(f.sleep, slot_thread[f.action], slot_instr[f.action]);
+	}
+	if (may_answer<M>()) add_to_level(next, next_sleep_set);
+      }
+      undo<M>(f);
+      if (M != MODEL_TSO || f.branch == 1) break;
+      f.branch = 1;
+      if (!enabled<M>(f)) break;
+    }
+    if (options->por && M != MODEL_SB) add_slot(f.sleep, f.action);
+  }
+}
+
+template <typename SlotSet>
+void Search<SlotSet>::add_to_level(Level& next, const SlotSet& sleep) {
+  string key = encode_state();
+  VisitedShard<SlotSet>& shard = next[hash<string>()(key) % VISITED_SHARDS];
+  unique_lock<mutex> guard(shard.lock, defer_lock);
+  if (shared->num_jobs > 1) guard.lock();
+  auto res = shard.states.insert(make_pair(key, sleep));
+  if (!res.second) {
+    res.first->second &= sleep;
+    shared->num_pruned++;
+  }
+}
+
+// Sampling (--samples, --time-budget): instead of exploring every
+// execution, run random ones from the current state until the walks
+// or the time run out. At every state one of the actions the other
+// engines would try is picked uniformly, so the solutions are a subset
+// of theirs. Each worker walks with its own copy of the search. The
+// combined search walks the relaxed model, and only the walks that
+// stay on a path of the store-atomic variant count for it too.
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::sample() {
+  int jobs = shared->num_jobs;
+  vector<unique_ptr<Search> > copies;
+  copy_workers(copies);
+  if (jobs == 1) {
+    copies[0]->template random_walks<M>();
+  } else {
+    vector<thread> workers;
+    for (int id = 0; id < jobs; id++) {
+      workers.push_back(thread(&Search::random_walks<M>, copies[id].get()));
+    }
+    for (int id = 0; id < jobs; id++) {
+      workers[id].join();
+    }
+  }
+  for (int id = 0; id < jobs; id++) {
+    merge_worker(*copies[id]);
+  }
+}
+
+template <typename SlotSet>
+template <int M>
+void Search<SlotSet>::random_walks() {
+  mt19937_64 random(worker_id + 1);
+  int num_actions = M == MODEL_SB ? 2 * num_threads : num_slots;
+  vector<Frame> path;
+  vector<int> choices;
+  for (;;) {
+    if (options->time_budget > 0 && chrono::steady_clock::now() >= shared->deadline) break;
+    if (options->max_walks > 0 && shared->walk_tickets++ >= options->max_walks) break;
+    num_walks++;
+    while (!all_executed()) {
+      Frame f;
+      f.sleep = SlotSet();
+      f.todo = ~SlotSet();
+      f.active = true;
+      f.ibm_path = ibm_path;
+      f.branch = 0;
+      choices.clear();
+      // The second TSO branch of a forwarding load reads the same
+      // store as the first, so it is not a choice of its own
+      for (f.action = 0; f.action < num_actions; f.action++) {
+	if (enabled<M>(f)) choices.push_back(f.action);
+      }
+      if (choices.empty()) break;
+      f.action = choices[random() % choices.size()];
+      run<M>(f);
+      path.push_back(f);
+    }
+    if (all_executed()) {
+      add_leaf<M>(); // gathers the outcome into leaf
+      if (M == MODEL_IBM || (M == MODEL_BOTH && ibm_path)) {
+	sample_counts[0][leaf]++;
+      }
+      if (M != MODEL_IBM) {
+	sample_counts[1][leaf]++;
+      }
+    }
+    while (!path.empty()) {
+      undo<M>(path.back());
+      path.pop_back();
+    }
+  }
+}
+
+// Explore one model (or both, with the combined search) from the
+// current state of c and add the solutions found to c
+template <typename SlotSet>
+void search_model(CheckerContext& c, int jobs,
+		  typename Search<SlotSet>::Engine engine, const char* name, int phase) {
+  const CheckerOptions& options = *c.options;
+  // A checkpoint holds every solution found, so then the search starts
+  // with those of the earlier phases
+  Solutions ibm, tso;
+  if (options.checkpoint_path.empty()) {
+    ibm.swap(c.solutions_ibm);
+    tso.swap(c.solutions_tso);
+  }
+  OutcomeCounts counts[2];
+  counts[0].swap(c.sample_counts[0]);
+  counts[1].swap(c.sample_counts[1]);
+  SharedSearch<SlotSet>* shared = new SharedSearch<SlotSet>(jobs);
+  // With -s the time budget is shared by both searches
+  shared->deadline = chrono::steady_clock::now()
+    + chrono::duration_cast<chrono::steady_clock::duration>
+    (chrono::duration<double>(options.time_budget / (options.combined ? 1 : 2)));
+  Search<SlotSet>* search = new Search<SlotSet>(c, shared);
+  search->num_leaves = 0;
+  search->num_walks = 0;
+  search->phase = phase;
+  const string& path = options.checkpoint_path;
+  if (options.resume && checkpoint_phase<SlotSet>(c, path) == phase) {
+    if (search->read_checkpoint(path)) {
+      if (c.log) *c.log << name << ": resumed from " << path << endl;
+    } else {
+      cerr << path << ": cannot read checkpoint, starting over" << endl;
+      for (int s = 0; s < VISITED_SHARDS; s++) {
+	shared->visited[s].states.clear();
+      }
+      shared->num_pruned = 0;
+      *search = Search<SlotSet>(c, shared);
+      search->num_leaves = 0;
+      search->phase = phase;
+    }
+  }
+  search->explore(engine);
+  c.solutions_ibm.swap(search->solutions_ibm);
+  c.solutions_tso.swap(search->solutions_tso);
+  c.solutions_ibm.insert(ibm.begin(), ibm.end());
+  c.solutions_tso.insert(tso.begin(), tso.end());
+  for (int model = 0; model < 2; model++) {
+    c.sample_counts[model].swap(search->sample_counts[model]);
+    for (auto it = counts[model].begin(); it != counts[model].end(); it++) {
+      c.sample_counts[model][it->first] += it->second;
+    }
+  }
+  c.num_explored += shared->num_visited();
+  c.num_pruned += shared->num_pruned;
+  c.num_leaves += search->num_leaves;
+  c.num_walks += search->num_walks;
+  if (c.log && options.sampling()) {
+    *c.log << name << ": " << search->num_walks << " random executions" << endl;
+  } else if (c.log) {
+    *c.log << name << ": " << shared->num_visited() << " states explored, "
+	   << shared->num_pruned << " pruned" << endl;
+    STAT(shared->stats.print(*c.log, name, c.num_slots));
+  }
+  delete search;
+  delete shared;
+}
+
+// Run the search of both models, specialized for SlotSet sets of
+// instructions
+template <typename SlotSet>
+void search(CheckerContext& c, int jobs) {
+  const CheckerOptions& options = *c.options;
+  const string& path = options.checkpoint_path;
+  c.solutions_ibm.clear();
+  c.solutions_tso.clear();
+  c.num_explored = 0;
+  c.num_pruned = 0;
+  c.num_leaves = 0;
+  c.num_walks = 0;
+  c.sample_counts[0].clear();
+  c.sample_counts[1].clear();
+  // A checkpoint of the second phase already holds the solutions of
+  // the first one
+  int resume_phase = options.resume ? checkpoint_phase<SlotSet>(c, path) : -1;
+  if (options.resume && resume_phase < 0 && c.log) {
+    *c.log << path << ": no checkpoint of this search, starting over" << endl;
+  }
+  if (options.combined) {
+    c.reset_executed();
+    c.build_po_graph_both();
+    c.skip_unprojected();
+    c.ibm_path = true;
+    search_model<SlotSet>(c, jobs, &Search<SlotSet>::get_possible_executions_both,
+			  (string(c.store_atomic_name()) + "+" + c.relaxed_name()).c_str(), 0);
+  } else {
+    if ((!c.has_target || (c.query_models & QUERY_IBM)) && resume_phase < 1) {
+      c.reset_executed();
+      c.build_po_graph_ibm();
+      c.skip_unprojected();
+      search_model<SlotSet>(c, jobs, &Search<SlotSet>::get_possible_executions_ibm,
+			    c.store_atomic_name(), 0);
+    }
+
+    if (!c.has_target || (c.query_models & QUERY_TSO)) {
+      c.reset_executed();
+      c.build_po_graph_tso();
+      if (options.store_buffers) {
+	search_model<SlotSet>(c, jobs, &Search<SlotSet>::get_possible_executions_sb,
+			      "TSO (store buffers)", 1);
+      } else {
+	c.skip_unprojected();
+	search_model<SlotSet>(c, jobs, &Search<SlotSet>::get_possible_executions_tso,
+			      c.relaxed_name(), 1);
+      }
+    }
+  }
+  // The search is complete, so its checkpoint is of no further use
+  if (!path.empty()) {
+    error_code ec;
+    filesystem::remove(path, ec);
+    filesystem::remove(path + ".tmp", ec);
+  }
+}
+
+// Axiomatic backend: instead of interleaving instructions, enumerate
+// the candidate executions of the program, a coherence order (co) of
+// the stores to each variable and a store each load reads from (rf),
+// and keep those the model allows. Reading from the initial value is
+// rf from no store. An execution is allowed if the union of the
+// preserved program order, rf, co and from-reads (fr: a load before
+// the stores that follow its rf store in co) is acyclic:
+//   IBM370: acyclic(ppo_ibm | rf | co | fr), ppo from IBM370
+//   TSO:    acyclic(ppo_tso | rfe | co | fr), ppo from TSO,
+//           and acyclic(po-loc | rf | co | fr) (per-variable SC)
+// where rfe are the rf edges across threads. Other relaxed models and
+// their variants use their own ppo in the same way. Events are instructions,
+// in slot order, and the graphs are kept transitively closed so that
+// every new edge is checked for cycles as soon as it is chosen.
+struct Axiomatic {
+  CheckerContext& c;
+  bool tso;
+  int num_events;
+  int num_words;
+  vector<uint64_t> ghb;     // reach[u] of the global happens-before
+  vector<uint64_t> uniproc; // TSO only: per-variable SC
+  vector<vector<int> > stores; // stores to each variable
+  vector<vector<int> > co;     // coherence order built so far
+  vector<int> loads;
+  vector<int> rf;              // store each load reads from, or -1
+  vector<uint64_t> saved;      // graphs before each choice
+  long long num_candidates;
+  bool done;
+
+  Axiomatic(CheckerContext& context, bool tso_model);
+  bool reaches(const vector<uint64_t>& reach, int u, int v);
+  bool add_edge(vector<uint64_t>& reach, int u, int v);
+  bool add_com_edge(int u, int v, bool external);
+  void save();
+  void restore();
+  int event_thread(int e);
+  void choose_co(size_t var);
+  void choose_rf(size_t k);
+  void add_execution();
+};
+
+Axiomatic::Axiomatic(CheckerContext& context, bool tso_model)
+  : c(context), tso(tso_model), num_candidates(0), done(false) {
+  num_events = c.num_slots;
+  num_words = (num_events + 63) / 64;
+  ghb.assign(num_events * num_words, 0);
+  stores.resize(c.num_memvars);
+  co.resize(c.num_memvars);
+  rf.assign(num_events, -1);
+  for (int t = 0; t < c.num_threads; t++) {
+    for (int i = 0; i < c.num_instrs[t]; i++) {
+      int e = c.first_slot[t] + i;
+      if (c.program[t][i].store) {
+	stores[c.program[t][i].mem].push_back(e);
+      } else {
+	loads.push_back(e);
+      }
+    }
+  }
+  // Program order, in order so that the sources are already closed
+  if (tso) c.build_po_graph_tso(); else c.build_po_graph_ibm();
+  for (int t = 0; t < c.num_threads; t++) {
+    for (int d = 0; d < c.num_instrs[t]; d++) {
+      for (int i = 0; i < d; i++) {
+	if (c.po[t][d] & ((InstrMask)1 << i)) {
+	  add_edge(ghb, c.first_slot[t] + i, c.first_slot[t] + d);
+	}
+      }
+    }
+  }
+  if (tso) {
+    uniproc.assign(num_events * num_words, 0);
+    for (int t = 0; t < c.num_threads; t++) {
+      for (int d = 0; d < c.num_instrs[t]; d++) {
+	for (int i = 0; i < d; i++) {
+	  if (c.program[t][i].mem == c.program[t][d].mem) {
+	    add_edge(uniproc, c.first_slot[t] + i, c.first_slot[t] + d);
+	  }
+	}
+      }
+    }
+  }
+}
+
+bool Axiomatic::reaches(const vector<uint64_t>& reach, int u, int v) {
+  return (reach[u * num_words + v / 64] >> (v % 64)) & 1;
+}
+
+// Adds u -> v and closes the graph; false if it makes a cycle
+bool Axiomatic::add_edge(vector<uint64_t>& reach, int u, int v) {
+  if (u == v || reaches(reach, v, u)) {
+    return false;
+  }
+  if (reaches(reach, u, v)) {
+    return true;
+  }
+  uint64_t* to = &reach[v * num_words];
+  for (int x = 0; x < num_events; x++) {
+    if (x == u || reaches(reach, x, u)) {
+      uint64_t* from = &reach[x * num_words];
+      for (int w = 0; w < num_words; w++) {
+	from[w] |= to[w];
+      }
+      from[v / 64] |= (uint64_t)1 << (v % 64);
+    }
+  }
+  return true;
+}
+
+// A communication edge (rf, co or fr); under TSO, rf edges within a
+// thread are only part of the per-variable order
+bool Axiomatic::add_com_edge(int u, int v, bool external) {
+  if ((!tso || external) && !add_edge(ghb, u, v)) {
+    return false;
+  }
+  return !tso || add_edge(uniproc, u, v);
+}
+
+void Axiomatic::save() {
+  saved.insert(saved.end(), ghb.begin(), ghb.end());
+  saved.insert(saved.end(), uniproc.begin(), uniproc.end());
+}
+
+void Axiomatic::restore() {
+  size_t pos = saved.size() - ghb.size() - uniproc.size();
+  copy(saved.begin() + pos, saved.begin() + pos + ghb.size(), ghb.begin());
+  copy(saved.begin() + pos + ghb.size(), saved.end(), uniproc.begin());
+  saved.resize(pos);
+}
+
+int Axiomatic::event_thread(int e) {
+  return c.slot_thread[e];
+}
+
+// Coherence order of each variable, one store at a time
+void Axiomatic::choose_co(size_t var) {
+  if (done) return;
+  if (var == co.size()) {
+    choose_rf(0);
+    return;
+  }
+  if (co[var].size() == stores[var].size()) {
+    choose_co(var + 1);
+    return;
+  }
+  for (size_t k = 0; k < stores[var].size(); k++) {
+    int s = stores[var][k];
+    if (find(co[var].begin(), co[var].end(), s) != co[var].end()) continue;
+    save();
+    if (co[var].empty() || add_com_edge(co[var].back(), s, true)) {
+      co[var].push_back(s);
+      choose_co(var);
+      co[var].pop_back();
+    }
+    restore();
+  }
+}
+
+// Store each load reads from
+void Axiomatic::choose_rf(size_t k) {
+  if (done) return;
+  num_candidates++;
+  if (k == loads.size()) {
+    add_execution();
+    return;
+  }
+  int l = loads[k];
+  int var = c.program[event_thread(l)][c.slot_instr[l]].mem;
+  const vector<int>& order = co[var];
+  for (int pos = -1; pos < (int)order.size(); pos++) {
+    save();
+    bool allowed = true;
+    if (pos >= 0) {
+      allowed = add_com_edge(order[pos], l, event_thread(order[pos]) != event_thread(l));
+    }
+    if (allowed && pos + 1 < (int)order.size()) {
+      allowed = add_com_edge(l, order[pos + 1], true); // fr
+    }
+    if (allowed) {
+      rf[l] = pos >= 0 ? order[pos] : -1;
+      choose_rf(k + 1);
+    }
+    restore();
+  }
+}
+
+void Axiomatic::add_execution() {
+  for (size_t var = 0; var < co.size(); var++) {
+    int last = co[var].empty() ? -1 : co[var].back();
+    c.memvalues[var] = last < 0 ? 0
+      : c.program[event_thread(last)][c.slot_instr[last]].value;
+  }
+  for (size_t k = 0; k < loads.size(); k++) {
+    int l = loads[k];
+    int value = rf[l] < 0 ? 0
+      : c.program[event_thread(rf[l])][c.slot_instr[rf[l]]].value;
+    c.update_load(event_thread(l), c.slot_instr[l], value);
+  }
+  if (!c.has_target || c.may_reach_target()) {
+    if (tso) {
+      c.add_possible_execution_tso();
+    } else {
+      c.add_possible_execution_ibm();
+    }
+    done = c.has_target;
+  }
+  for (size_t var = 0; var < co.size(); var++) {
+    c.memvalues[var] = 0;
+  }
+  for (size_t k = 0; k < loads.size(); k++) {
+    c.update_load(event_thread(loads[k]), c.slot_instr[loads[k]], 0);
+  }
+}
+
+void check_axiomatic(CheckerContext& c) {
+  c.solutions_ibm.clear();
+  c.solutions_tso.clear();
+  c.num_explored = 0;
+  c.num_pruned = 0;
+  c.num_leaves = 0;
+  for (int model = 0; model < 2; model++) {
+    bool tso = model == 1;
+    if (c.has_target && !(c.query_models & (tso ? QUERY_TSO : QUERY_IBM))) continue;
+    // Every instruction has executed in a candidate execution
+    c.reset_executed();
+    for (int t = 0; t < c.num_threads; t++) {
+      c.pending[t] = 0;
+    }
+    c.num_pending = 0;
+    Axiomatic axiomatic(c, tso);
+    axiomatic.choose_co(0);
+    c.num_explored += axiomatic.num_candidates;
+    if (c.log) {
+      *c.log << (tso ? c.relaxed_name() : c.store_atomic_name()) << " (axiomatic): "
+	     << axiomatic.num_candidates << " partial executions explored" << endl;
+    }
+  }
+}
+
+// Calls run with an empty set of slots of the narrowest type that
+// holds the instructions of c, for which the searches are instantiated
+template <typename Run>
+void with_slot_set(const CheckerContext& c, Run run) {
+  if (c.num_slots <= 64) {
+    run(uint64_t());
+  } else if (c.num_slots <= 256) {
+    run(bitset<256>());
+  } else {
+    run(bitset<MAX_SLOTS>());
+  }
+}
+
+void check(CheckerContext& c, int jobs) {
+  c.build_symmetry();
+  if (c.options->axiomatic) {
+    check_axiomatic(c);
+    return;
+  }
+  with_slot_set(c, [&](auto slots) {
+      search<decltype(slots)>(c, jobs);
+    });
+}
+
+
+// The options of a check that are out of range or do not apply
+// together, both on the command line and in the library; false, with
+// the reason in error, if any
+bool validate_options(const CheckerOptions& options, string& error) {
+  if (options.model < RELAXED_TSO || options.model > RELAXED_ARM) {
+    error = "unknown model";
+  } else if (options.num_jobs < 1) {
+    error = "no worker threads";
+  } else if (options.buffer_depth < 0 || options.max_walks < 0 || options.time_budget < 0
+	     || options.checkpoint_interval <= 0) {
+    error = "negative store buffer depth, sampling limit or checkpoint interval";
+  } else if (options.store_buffers && options.model != RELAXED_TSO) {
+    error = "-B only models TSO";
+  } else if (options.frontier && options.axiomatic) {
+    error = "-F and -a are different engines";
+  } else if (options.sampling() && (options.frontier || options.axiomatic)) {
+    error = "sampling does not apply to -F or -a";
+  } else if (options.resume && options.checkpoint_path.empty()) {
+    error = "--resume needs --checkpoint FILE";
+  } else if (!options.checkpoint_path.empty()
+	     && (options.num_jobs > 1 || options.frontier || options.axiomatic
+		 || options.sampling())) {
+    error = "--checkpoint only applies to the depth-first search, with one worker";
+  } else {
+    return true;
+  }
+  return false;
+}
+
+// Library API. Each calling thread reuses its own context, and the
+// options are only read through it.
+bool check(const string& program, const CheckerOptions& options, const OutcomeSink& sink,
+	   string& error, ProgramLayout* layout) {
+  static thread_local unique_ptr<CheckerContext> context;
+  if (!context) context.reset(new CheckerContext);
+  CheckerContext& c = *context;
+  c.reset();
+  if (!validate_options(options, error)) {
+    return false;
+  }
+  // The sink keeps no solutions, so a checkpoint would hold none, and
+  // a resumed search would pass it again those found before
+  if (!options.checkpoint_path.empty()) {
+    error = "checkpoints do not apply to a sink";
+    return false;
+  }
+  // As with -B, store buffers run the two searches separately
+  CheckerOptions opts = options;
+  opts.combined = options.combined && !options.store_buffers;
+  c.options = &opts;
+  if (!c.parse(program.data(), program.data() + program.size(), 1, error)) {
+    return false;
+  }
+  if (layout) {
+    layout->vars.clear();
+    layout->loads.clear();
+    for (int v = 0; v < c.num_memvars; v++) {
+      layout->vars.push_back(c.memvar(v));
+    }
+    for (int t = 0; t < c.num_threads; t++) {
+      for (int i = 0; i < c.num_instrs[t]; i++) {
+	if (!c.program[t][i].store) layout->loads.push_back(make_pair(t, i));
+      }
+    }
+  }
+  SolutionStream stream(sink);
+  c.stream = &stream;
+  check(c, opts.num_jobs);
+  c.stream = NULL;
+  return true;
+}
+
+// Hashes of the program and of the options that change its results
+uint64_t hash_bytes(uint64_t h, const void* data, size_t size) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t pos = 0; pos < size; pos++) {
+    h = (h ^ bytes[pos]) * 1099511628211ULL; // FNV-1a
+  }
+  return h;
+}
+
+uint64_t thread_hash(const CheckerContext& c, int t) {
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < c.num_instrs[t]; i++) {
+    const Instr& instr = c.program[t][i];
+    const char* var = c.memvar(instr.mem);
+    h = hash_bytes(h, &instr.store, sizeof(instr.store));
+    h = hash_bytes(h, var, strlen(var) + 1);
+    if (instr.store) h = hash_bytes(h, &instr.value, sizeof(instr.value));
+  }
+  return h;
+}
+
+// A checkpoint depends on the options that change the results or
+// shape the search tree, and on the projection
+uint64_t checkpoint_key(const CheckerContext& c) {
+  const CheckerOptions& o = *c.options;
+  int options[] = {o.model, o.store_buffers, o.buffer_depth, o.axiomatic,
+		   o.por, o.combined, o.symmetry};
+  uint64_t h = hash_bytes(14695981039346656037ULL, options, sizeof(options));
+  if (c.projected) {
+    h = hash_bytes(h, c.project_var, c.num_memvars * sizeof(bool));
+    h = hash_bytes(h, c.project_loads, c.num_threads * sizeof(InstrMask));
+  }
+  for (int t = 0; t < c.num_threads; t++) {
+    uint64_t thread = thread_hash(c, t);
+    h = hash_bytes(h, &thread, sizeof(thread));
+  }
+  return h;
+}
+
+// Result cache (-c DIR): programs that only differ in the names of
+// their variables, the order of their threads or the values they
+// store have the same outcomes up to renaming. A program is checked
+// in a canonical form, whose results are kept in DIR under its hash
+// and mapped back to the names, threads and values of the program.
+// Variables are renamed in order of first use, and the values stored
+// to each variable in order of first store (0, the initial value,
+// stays 0). Threads are sorted by their instructions renamed on their
+// own, and those that are then equal are put in the order that gives
+// the least canonical text. With too many such orders they are sorted
+// again after renaming until the order is stable, and programs that
+// are equal up to an order this does not find are cached separately.
+#define MAX_CANONICAL_ORDERS 5040
+
+struct Canonical {
+  vector<int> thread;          // thread of the program of each canonical thread
+  vector<int> var;             // same, for the variables
+  vector<vector<int> > value;  // value of each canonical value, per variable
+  vector<int> first_load;      // position of the first load of each thread
+  string text;                 // canonical program
+};
+
+// Renames the variables and values of the given threads of c, in that
+// order, by first use, into the text of each thread (vars lists the
+// variables in order of first use)
+void rename_threads(const CheckerContext& c, const vector<int>& order, vector<int>& vars,
+		    vector<unordered_map<int, int> >& value_id, vector<string>& threads) {
+  vector<int> var_id(c.num_memvars, -1);
+  value_id.assign(c.num_memvars, unordered_map<int, int>());
+  vars.clear();
+  for (size_t k = 0; k < order.size(); k++) {
+    int t = order[k];
+    stringstream ss;
+    for (int i = 0; i < c.num_instrs[t]; i++) {
+      const Instr& instr = c.program[t][i];
+      if (var_id[instr.mem] < 0) {
+	var_id[instr.mem] = vars.size();
+	vars.push_back(instr.mem);
+	value_id[instr.mem][0] = 0;
+      }
+      ss << (instr.store ? "st v" : "ld v") << var_id[instr.mem];
+      if (instr.store) {
+	unordered_map<int, int>& ids = value_id[instr.mem];
+	auto it = ids.insert(make_pair(instr.value, (int)ids.size())).first;
+	ss << " " << it->second;
+      }
+      ss << "\n";
+    }
+    threads[t] = ss.str();
+  }
+}
+
+void canonicalize(const CheckerContext& c, Canonical& canon) {
+  // Start from the order of the threads renamed on their own
+  vector<int> order;
+  vector<int> vars;
+  vector<unordered_map<int, int> > value_id;
+  vector<string> threads(c.num_threads);
+  for (int t = 0; t < c.num_threads; t++) {
+    order.push_back(t);
+    rename_threads(c, vector<int>(1, t), vars, value_id, threads);
+  }
+  stable_sort(order.begin(), order.end(),
+	      [&](int a, int b) { return threads[a] < threads[b]; });
+
+  // Threads that look alike on their own are tried in every order
+  // among themselves, if there are few such orders, keeping the least
+  // text. Otherwise they are sorted again after every renaming.
+  vector<pair<int, int> > groups;
+  long long num_orders = 1;
+  for (int k = 0, end; k < c.num_threads; k = end) {
+    for (end = k + 1; end < c.num_threads && threads[order[end]] == threads[order[k]]; end++) {
+      num_orders = min(num_orders * (end - k + 1), (long long)MAX_CANONICAL_ORDERS + 1);
+    }
+    groups.push_back(make_pair(k, end));
+  }
+  if (num_orders <= MAX_CANONICAL_ORDERS) {
+    vector<int> best;
+    string best_text;
+    for (bool more = true; more; ) {
+      rename_threads(c, order, vars, value_id, threads);
+      string text;
+      for (size_t k = 0; k < order.size(); k++) {
+	text += threads[order[k]] + "---\n";
+      }
+      if (best.empty() || text < best_text) {
+	best = order;
+	best_text = text;
+      }
+      more = false;
+      for (size_t g = groups.size(); g-- > 0 && !more; ) {
+	more = next_permutation(order.begin() + groups[g].first, order.begin() + groups[g].second);
+      }
+    }
+    order = best;
+    rename_threads(c, order, canon.var, value_id, threads);
+  } else {
+    for (int round = 0; round <= c.num_threads; round++) {
+      rename_threads(c, order, canon.var, value_id, threads);
+      vector<int> sorted = order;
+      stable_sort(sorted.begin(), sorted.end(),
+		  [&](int a, int b) { return threads[a] < threads[b]; });
+      if (sorted == order || round == c.num_threads) break;
+      order = sorted;
+    }
+  }
+  canon.thread = order;
+  canon.text.clear();
+  for (size_t k = 0; k < order.size(); k++) {
+    canon.text += threads[order[k]] + "---\n";
+  }
+  canon.value.assign(canon.var.size(), vector<int>());
+  for (size_t v = 0; v < canon.var.size(); v++) {
+    unordered_map<int, int>& ids = value_id[canon.var[v]];
+    canon.value[v].resize(ids.size());
+    for (auto it = ids.begin(); it != ids.end(); it++) {
+      canon.value[v][it->second] = it->first;
+    }
+  }
+  canon.first_load.assign(c.num_threads, c.num_memvars);
+  for (int t = 1; t < c.num_threads; t++) {
+    canon.first_load[t] = canon.first_load[t - 1];
+    for (int i = 0; i < c.num_instrs[t - 1]; i++) {
+      canon.first_load[t] += !c.program[t - 1][i].store;
+    }
+  }
+}
+
+// An outcome of the canonical program ct as one of the program
+Outcome map_outcome(const CheckerContext& ct, const Canonical& canon, const Outcome& o) {
+  Outcome mapped(o.size());
+  for (int v = 0; v < ct.num_memvars; v++) {
+    mapped[canon.var[v]] = canon.value[v][o[v]];
+  }
+  int pos = ct.num_memvars;
+  for (int k = 0; k < ct.num_threads; k++) {
+    int load = canon.first_load[canon.thread[k]];
+    for (int i = 0; i < ct.num_instrs[k]; i++) {
+      if (!ct.program[k][i].store) {
+	mapped[load++] = canon.value[ct.program[k][i].mem][o[pos++]];
+      }
+    }
+  }
+  return mapped;
+}
+
+// Cache entries: "CCC1", the size of the key, the key (the options
+// that change the results and the program text), then the results in
+// the binary format
+string entry_key(const CheckerOptions& options, const string& text) {
+  stringstream key;
+  key << "-M " << options.model << " -B " << options.store_buffers << " "
+      << options.buffer_depth << " -a " << options.axiomatic << "\n" << text;
+  return key.str();
+}
+
+// Reads the results of the entry at path into c if its key is key
+bool read_entry(const string& path, const string& key, CheckerContext& c) {
+  ifstream in(path, ios::binary);
+  char magic[4];
+  if (!in.read(magic, 4) || memcmp(magic, "CCC1", 4) != 0) {
+    return false;
+  }
+  string saved(read_word(in), '\0');
+  in.read(&saved[0], saved.size());
+  return in && saved == key && c.read_results(in);
+}
+
+void write_entry(const string& path, const string& key, CheckerContext& c) {
+  // Concurrent runs and batch workers may write the same entry
+  string tmp = path + "." + to_string(getpid()) + "."
+    + to_string(hash<thread::id>()(this_thread::get_id()));
+  bool written = write_aside(path, tmp, [&](ostream& out) {
+      out.write("CCC1", 4);
+      write_word(out, key.size());
+      out.write(key.data(), key.size());
+      c.write_results(out);
+    });
+  if (!written) {
+    cerr << path << ": cannot write results" << endl;
+  }
+}
+
+void check_cached(CheckerContext& c, int jobs, const string& dir) {
+  Canonical canon;
+  canonicalize(c, canon);
+  string key = entry_key(*c.options, canon.text);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.res",
+	   (unsigned long long)hash_bytes(14695981039346656037ULL, key.data(), key.size()));
+  string path = (filesystem::path(dir) / name).string();
+
+  unique_ptr<CheckerContext> ct(new CheckerContext);
+  string error;
+  ct->parse(canon.text.data(), canon.text.data() + canon.text.size(), 1, error);
+  ct->options = c.options;
+  ct->log = c.log;
+  if (read_entry(path, key, *ct)) {
+    if (c.log) *c.log << "cache: results read from " << path << endl;
+  } else {
+    check(*ct, jobs);
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    write_entry(path, key, *ct);
+  }
+  c.solutions_ibm.clear();
+  c.solutions_tso.clear();
+  for (auto it = ct->solutions_ibm.begin(); it != ct->solutions_ibm.end(); it++) {
+    c.solutions_ibm.insert(map_outcome(*ct, canon, *it));
+  }
+  for (auto it = ct->solutions_tso.begin(); it != ct->solutions_tso.end(); it++) {
+    c.solutions_tso.insert(map_outcome(*ct, canon, *it));
+  }
+  c.num_explored = ct->num_explored;
+  c.num_pruned = ct->num_pruned;
+  c.num_leaves = ct->num_leaves;
+}
+
+// Program input and output
+void CheckerContext::reset() {
+  num_threads = 0;
+  max_instrs = 0;
+  num_memvars = 0;
+  var_names.clear();
+  num_slots = 0;
+  for (int t = 0; t < MAX_THREADS; t++) {
+    num_instrs[t] = 0;
+  }
+  memset(loadvalues, 0, sizeof(loadvalues));
+  solutions_ibm.clear();
+  solutions_tso.clear();
+  num_explored = 0;
+  num_pruned = 0;
+  num_leaves = 0;
+  num_walks = 0;
+  sample_counts[0].clear();
+  sample_counts[1].clear();
+  log = NULL;
+  stream = NULL;
+  recent.clear();
+  symmetric = false;
+  symmetry_classes.clear();
+  renamings.clear();
+  has_target = false;
+  query_models = QUERY_IBM | QUERY_TSO;
+  for (int t = 0; t < MAX_THREADS; t++) {
+    target_loads[t] = 0;
+  }
+  projected = false;
+  memset(project_var, 0, sizeof(project_var));
+  for (int t = 0; t < MAX_THREADS; t++) {
+    project_loads[t] = 0;
+    skipped[t] = 0;
+  }
+  target_vars.clear();
+  target_values.clear();
+  target_stores.clear();
+  target_matching.clear();
+}
+
+// Tokens of a line are separated by blanks, and are not copied
+bool is_blank(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+const char* next_token(const char*& pos, const char* eol, size_t& len) {
+  while (pos < eol && is_blank(*pos)) pos++;
+  const char* token = pos;
+  while (pos < eol && !is_blank(*pos)) pos++;
+  len = pos - token;
+  return len ? token : NULL;
+}
+
+bool token_is(const char* token, size_t len, const char* word) {
+  return len == strlen(word) && memcmp(token, word, len) == 0;
+}
+
+bool parse_int(const char* token, size_t len, int& value) {
+  size_t pos = len > 1 && (token[0] == '-' || token[0] == '+') ? 1 : 0;
+  bool negative = pos && token[0] == '-';
+  long long v = 0;
+  for (; pos < len; pos++) {
+    if (token[pos] < '0' || token[pos] > '9') return false;
+    v = v * 10 + (token[pos] - '0');
+    if (v > (long long)INT32_MAX + 1) return false;
+  }
+  v = negative ? -v : v;
+  if (v > INT32_MAX) return false;
+  value = v;
+  return true;
+}
+
+bool parse_error(string& error, int line, const string& reason) {
+  error = "line " + to_string(line) + ": " + reason;
+  return false;
+}
+
+// Reads a program from the text [begin, end), whose first line is
+// line: one instruction per line, and "---" at the end of each thread.
+// Returns false, with the line and the reason in error, if the
+// program is not well formed.
+bool CheckerContext::parse(const char* begin, const char* end, int line,
+			   string& error) {
+  int num_thread = 0;
+  int num_instr = 0;
+  int last_line = line;
+  for (const char* pos = begin; pos < end; line++) {
+    const char* eol = (const char*)memchr(pos, '\n', end - pos);
+    if (!eol) eol = end;
+    size_t op_len, var_len, value_len;
+    const char* op = next_token(pos, eol, op_len);
+    const char* var = next_token(pos, eol, var_len);
+    const char* value = next_token(pos, eol, value_len);
+    pos = eol < end ? eol + 1 : end;
+    if (!op) continue;
+    last_line = line;
+    Instr i;
+    if (token_is(op, op_len, "---")) {
+      if (num_thread == MAX_THREADS) {
+	return parse_error(error, line, "too many threads");
+      }
+      num_instrs[num_thread] = num_instr;
+      if (num_instr > max_instrs) {
+	max_instrs = num_instr;
+      }
+      num_thread++;
+      num_instr = 0;
+    } else if (token_is(op, op_len, "st") || token_is(op, op_len, "ld")) {
+      i.store = op[0] == 's';
+      if (!var) {
+	return parse_error(error, line, "missing variable");
+      }
+      if (i.store && !value) {
+	return parse_error(error, line, "missing value");
+      }
+      if (i.store && !parse_int(value, value_len, i.value)) {
+	return parse_error(error, line, "bad value " + string(value, value_len));
+      }
+      if (num_thread == MAX_THREADS) {
+	return parse_error(error, line, "too many threads");
+      }
+      if (num_instr >= MAX_INSTRUCTIONS) {
+	return parse_error(error, line, "too many instructions in a thread");
+      }
+      i.mem = insert_memvar(var, var_len);
+      program[num_thread][num_instr] = i;
+      loadvalues[num_thread][num_instr] = 0;
+      num_instr++;
+    } else {
+      return parse_error(error, line, "unknown instruction " + string(op, op_len));
+    }
+  }
+  if (num_instr > 0) {
+    return parse_error(error, last_line, "missing --- after the last thread");
+  }
+  num_threads = num_thread;
+  build_slots();
+  build_store_buffers();
+  return true;
+}
+
+void CheckerContext::print_instr(ostream& out, Instr i) {
+  if (i.store) {
+    out << "st " << memvar(i.mem) << ", " << i.value;   
+  } else {
+    out << "ld " << memvar(i.mem);
+  }
+}
   
-  return 0;
+void CheckerContext::print_program(ostream& out) {
+  for (int i = 0; i < max_instrs; i++) {
+    for (int t = 0; t < num_threads; t++) {
+      if (i < num_instrs[t]) {
+	print_instr(out, program[t][i]);
+	out << "\t\t";
+      } else {
+	out << "\t\t\t";
+      }
+    }
+    out << endl;
+  }
+}
+
+
+// Input files are mapped in memory, or read if they cannot be (a pipe,
+// or an empty file), and their programs are parsed from there.
+struct InputFile {
+  const char* data;
+  size_t size;
+  void* mapping;
+  string buffer;
+
+  InputFile() : data(NULL), size(0), mapping(NULL) {}
+  ~InputFile() {
+    if (mapping) munmap(mapping, size);
+  }
+  bool open(const string& path); // the standard input if path is empty
+};
+
+bool InputFile::open(const string& path) {
+  int fd = path.empty() ? 0 : ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      mapping = NULL;
+    } else {
+      madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+      data = (const char*)mapping;
+      size = st.st_size;
+    }
+  }
+  bool ok = true;
+  if (!mapping) {
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+      buffer.append(chunk, n);
+    }
+    ok = n == 0;
+    data = buffer.data();
+    size = buffer.size();
+  }
+  if (fd != 0) close(fd);
+  return ok;
+}
+
+// A program of an input file. A file may hold several programs, each
+// after a line "=== NAME" (the name is optional); name is empty if it
+// holds a single program without that line. Programs without a name
+// are numbered from 1 in the file.
+typedef struct test_ {
+  string path;
+  string name;
+  const char* begin;
+  const char* end;
+  int line;      // of begin
+  string error;  // if the file could not be read
+} Test;
+
+string test_name(const Test& test) {
+  return test.name.empty() ? test.path : test.path + ":" + test.name;
+}
+
+void split_programs(const InputFile& file, const string& path, vector<Test>& tests) {
+  const char* end = file.data + file.size;
+  Test test;
+  test.path = path;
+  test.begin = file.data;
+  test.line = 1;
+  size_t first = tests.size();
+  int num_headers = 0;
+  int line = 1;
+  for (const char* pos = file.data; pos < end; line++) {
+    const char* eol = (const char*)memchr(pos, '\n', end - pos);
+    if (!eol) eol = end;
+    if (eol - pos >= 3 && memcmp(pos, "===", 3) == 0) {
+      test.end = pos;
+      // Only text before the first header may be blank
+      const char* p = test.begin;
+      while (p < test.end && (is_blank(*p) || *p == '\n')) p++;
+      if (num_headers > 0 || p < test.end) {
+	tests.push_back(test);
+      }
+      num_headers++;
+      const char* name = pos + 3;
+      const char* last = eol;
+      while (name < last && is_blank(*name)) name++;
+      while (last > name && is_blank(last[-1])) last--;
+      test.name.assign(name, last);
+      test.begin = eol < end ? eol + 1 : end;
+      test.line = line + 1;
+    }
+    pos = eol < end ? eol + 1 : end;
+  }
+  test.end = end;
+  tests.push_back(test);
+  for (size_t k = first; num_headers > 0 && k < tests.size(); k++) {
+    if (tests[k].name.empty()) {
+      tests[k].name = "#" + to_string(k - first + 1);
+    }
+  }
+}
+
+// Reads the programs of the given files; files keeps their text
+void load_tests(const vector<string>& paths, vector<unique_ptr<InputFile> >& files,
+		vector<Test>& tests) {
+  for (size_t k = 0; k < paths.size(); k++) {
+    unique_ptr<InputFile> file(new InputFile);
+    if (!file->open(paths[k])) {
+      Test test;
+      test.path = paths[k];
+      test.begin = test.end = NULL;
+      test.line = 0;
+      test.error = "cannot open file";
+      tests.push_back(test);
+      continue;
+    }
+    split_programs(*file, paths[k], tests);
+    files.push_back(move(file));
+  }
+}
+
+
+// Batch mode: the tests are the programs of the .in files of a
+// directory, of the files listed in a manifest (one path per line, #
+// for comments), or of a single stream of programs.
+// Tests are checked over a pool of num_jobs threads, each reusing its
+// own context, and the results are written as one JSON line per test,
+// in input order, or as one result file per test.
+bool list_tests(const string& path, vector<string>& tests) {
+  error_code ec;
+  if (filesystem::is_directory(path, ec)) {
+    filesystem::directory_iterator it(path, ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+      if (it->is_regular_file() && it->path().extension() == ".in") {
+	tests.push_back(it->path().string());
+      }
+    }
+    sort(tests.begin(), tests.end());
+    return !ec;
+  }
+  ifstream manifest(path);
+  if (!manifest) {
+    return false;
+  }
+  string line;
+  while (getline(manifest, line)) {
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == string::npos || line[first] == '#') continue;
+    if (tests.empty() && line.compare(0, 3, "===") == 0) {
+      tests.push_back(path); // a stream of programs, not a manifest
+      return true;
+    }
+    size_t last = line.find_last_not_of(" \t\r");
+    tests.push_back(line.substr(first, last - first + 1));
+  }
+  return true;
+}
+
+string json_string(const string& s) {
+  stringstream ss;
+  ss << '"';
+  for (size_t pos = 0; pos < s.size(); pos++) {
+    unsigned char ch = s[pos];
+    if (ch == '"' || ch == '\\') {
+      ss << '\\' << ch;
+    } else if (ch < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      ss << buf;
+    } else {
+      ss << ch;
+    }
+  }
+  ss << '"';
+  return ss.str();
+}
+
+// Formatted outcomes as a JSON array, without the trailing blank. Only
+// those selected by only, if given.
+string json_solutions(const SortedSolutions& sorted, const vector<bool>* only) {
+  stringstream ss;
+  ss << "[";
+  bool first = true;
+  for (size_t pos = 0; pos < sorted.size(); pos++) {
+    if (only && !(*only)[pos]) continue;
+    string text = sorted[pos].first;
+    if (!text.empty() && text[text.size() - 1] == ' ') {
+      text.erase(text.size() - 1);
+    }
+    ss << (first ? "" : ",") << json_string(text);
+    first = false;
+  }
+  ss << "]";
+  return ss.str();
+}
+
+// Checks one test, reusing c, and returns its JSON line (or writes its
+// result file into output_dir and returns an empty line)
+string check_test(CheckerContext& c, const Test& test, const string& output_dir,
+		  const CommandLine& cl) {
+  c.reset();
+  string error = test.error;
+  if (error.empty() && c.parse(test.begin, test.end, test.line, error)
+      && (cl.query.empty() || c.parse_target(cl.query, cl.query_models, error))
+      && (cl.projection.empty() || c.parse_projection(cl.projection, error))) {
+    if (!cl.cache_dir.empty() && !c.has_target) {
+      check_cached(c, 1, cl.cache_dir);
+    } else {
+      check(c, 1);
+    }
+    if (!output_dir.empty()) {
+      string stem = filesystem::path(test.path).stem().string();
+      if (!test.name.empty()) {
+	string name = test.name;
+	replace(name.begin(), name.end(), '/', '_');
+	stem += "-" + name;
+      }
+      filesystem::path out_path = filesystem::path(output_dir)
+	/ (stem + (cl.binary_output ? ".bin" : ".out"));
+      ofstream out(out_path, ios::binary);
+      if (!out) {
+	cerr << out_path.string() << ": cannot write result" << endl;
+	return "";
+      }
+      if (cl.binary_output) {
+	c.write_results(out);
+	return "";
+      }
+      out << "PROGRAM LOADED:" << endl;
+      c.print_program(out);
+      out << endl;
+      if (c.has_target) {
+	c.print_query(out, cl.query);
+      } else {
+	c.print_solutions(out);
+	if (cl.sampling()) c.print_coverage(out);
+      }
+      return "";
+    }
+    stringstream ss;
+    ss << "{\"test\":" << json_string(test_name(test));
+    if (c.has_target) {
+      if (c.query_models & QUERY_IBM) {
+	ss << ",\"ibm\":" << (c.solutions_ibm.empty() ? "\"forbidden\"" : "\"allowed\"");
+      }
+      if (c.query_models & QUERY_TSO) {
+	ss << ",\"tso\":" << (c.solutions_tso.empty() ? "\"forbidden\"" : "\"allowed\"");
+      }
+      ss << ",\"states\":" << c.num_explored
+	 << ",\"pruned\":" << c.num_pruned << "}";
+      return ss.str();
+    }
+    SortedSolutions sorted_ibm = c.sort_solutions(c.solutions_ibm);
+    SortedSolutions sorted_tso = c.sort_solutions(c.solutions_tso);
+    vector<bool> breaks = c.breaks_store_atomicity(sorted_ibm, sorted_tso);
+    ss << ",\"ibm\":" << json_solutions(sorted_ibm, NULL)
+       << ",\"tso\":" << json_solutions(sorted_tso, NULL)
+       << ",\"breaks_store_atomicity\":" << json_solutions(sorted_tso, &breaks)
+       << ",\"num_breaks\":" << count(breaks.begin(), breaks.end(), true)
+       << ",\"states\":" << c.num_explored
+       << ",\"pruned\":" << c.num_pruned << "}";
+    return ss.str();
+  }
+  if (!output_dir.empty()) {
+    cerr << test_name(test) << ": " << error << endl;
+    return "";
+  }
+  return "{\"test\":" + json_string(test_name(test)) + ",\"error\":"
+    + json_string(error) + "}";
+}
+
+typedef struct batch_ {
+  const CommandLine* cl;
+  vector<Test> tests;
+  string output_dir;
+  atomic<size_t> next_test;
+  vector<string> lines;
+  vector<bool> done;
+  size_t next_line;
+  mutex lock;
+} Batch;
+
+void run_batch_worker(Batch* batch) {
+  unique_ptr<CheckerContext> c(new CheckerContext);
+  c->options = batch->cl;
+  size_t k;
+  while ((k = batch->next_test++) < batch->tests.size()) {
+    string line = check_test(*c, batch->tests[k], batch->output_dir, *batch->cl);
+    lock_guard<mutex> guard(batch->lock);
+    batch->lines[k] = line;
+    batch->done[k] = true;
+    while (batch->next_line < batch->tests.size()
+	   && batch->done[batch->next_line]) {
+      if (!batch->lines[batch->next_line].empty()) {
+	cout << batch->lines[batch->next_line] << endl;
+      }
+      batch->lines[batch->next_line].clear();
+      batch->next_line++;
+    }
+  }
+}
+
+void run_batch(const vector<Test>& tests, const string& output_dir, const CommandLine& cl) {
+  Batch batch;
+  batch.cl = &cl;
+  batch.tests = tests;
+  batch.output_dir = output_dir;
+  batch.next_test = 0;
+  batch.lines.resize(tests.size());
+  batch.done.resize(tests.size(), false);
+  batch.next_line = 0;
+  vector<thread> workers;
+  for (int id = 0; id < cl.num_jobs; id++) {
+    workers.push_back(thread(run_batch_worker, &batch));
+  }
+  for (int id = 0; id < cl.num_jobs; id++) {
+    workers[id].join();
+  }
+}
+
+// Benchmark mode: times the IBM370 and TSO searches separately over a
+// generated corpus of litmus shapes, scaled by the number of threads
+// and by repeating the accesses of each thread, and reports one JSON
+// line per test and model
+typedef struct bench_test_ {
+  const char* shape;
+  int threads;
+  int reps;
+} BenchTest;
+
+BenchTest bench_corpus[] = {
+  {"SB", 2, 1}, {"SB", 4, 1}, {"SB", 3, 2}, {"SB", 4, 2}, {"SB", 3, 3},
+  {"MP", 2, 1}, {"MP", 4, 1}, {"MP", 3, 2}, {"MP", 4, 2}, {"MP", 3, 3},
+  {"IRIW", 4, 1}, {"IRIW", 6, 1}, {"IRIW", 4, 2},
+  {"2+2W", 2, 1}, {"2+2W", 4, 1}, {"2+2W", 4, 2}, {"2+2W", 6, 2}, {"2+2W", 4, 3},
+  {"n6", 2, 1}, {"n6", 2, 3}, {"n6", 2, 4}, {"n6", 2, 5},
+};
+
+// Program text of a shape. Every repetition stores new values.
+//   SB:   thread k stores x<k> and loads x<k+1>
+//   MP:   thread 0 stores data then flag, the others load flag then data
+//   IRIW: half of the threads store one variable each, the others load
+//         all of them, each reader starting from a different one
+//   2+2W: thread k stores x<k> then x<k+1>
+//   n6:   st x; ld x; ld y against st y; st x
+string bench_program(const BenchTest& test) {
+  stringstream ss;
+  int n = test.threads;
+  int writers = (n + 1) / 2;
+  for (int t = 0; t < n; t++) {
+    for (int r = 1; r <= test.reps; r++) {
+      string shape = test.shape;
+      if (shape == "SB") {
+	ss << "st x" << t << " " << r << endl;
+	ss << "ld x" << (t + 1) % n << endl;
+      } else if (shape == "MP" && t == 0) {
+	ss << "st data " << r << endl << "st flag " << r << endl;
+      } else if (shape == "MP") {
+	ss << "ld flag" << endl << "ld data" << endl;
+      } else if (shape == "IRIW" && t < writers) {
+	ss << "st x" << t << " " << r << endl;
+      } else if (shape == "IRIW") {
+	for (int v = 0; v < writers; v++) {
+	  ss << "ld x" << (t + v) % writers << endl;
+	}
+      } else if (shape == "2+2W") {
+	ss << "st x" << t << " " << 2*r - 1 << endl;
+	ss << "st x" << (t + 1) % n << " " << 2*r << endl;
+      } else if (shape == "n6" && t == 0) {
+	ss << "st x " << 2*r - 1 << endl << "ld x" << endl << "ld y" << endl;
+      } else if (shape == "n6") {
+	ss << "st y " << 2*r << endl << "st x " << 2*r << endl;
+      }
+    }
+    ss << "---" << endl;
+  }
+  return ss.str();
+}
+
+template <typename SlotSet>
+void bench_search(CheckerContext& c, bool tso) {
+  const CheckerOptions& options = *c.options;
+  c.reset_executed();
+  if (tso) {
+    c.build_po_graph_tso();
+    search_model<SlotSet>(c, options.num_jobs, options.store_buffers
+			  ? &Search<SlotSet>::get_possible_executions_sb
+			  : &Search<SlotSet>::get_possible_executions_tso, c.relaxed_name(), 0);
+  } else {
+    c.build_po_graph_ibm();
+    search_model<SlotSet>(c, options.num_jobs, &Search<SlotSet>::get_possible_executions_ibm,
+			  c.store_atomic_name(), 0);
+  }
+}
+
+// Peak resident set of the process so far; the corpus grows, so it
+// is mostly that of the last test
+long max_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void run_bench(const CheckerOptions& options) {
+  unique_ptr<CheckerContext> c(new CheckerContext);
+  c->options = &options;
+  for (size_t k = 0; k < sizeof(bench_corpus) / sizeof(bench_corpus[0]); k++) {
+    const BenchTest& test = bench_corpus[k];
+    stringstream name;
+    name << test.shape << "-" << test.threads << "x" << test.reps;
+    for (int model = 0; model < 2; model++) {
+      bool tso = model == 1;
+      c->reset();
+      string error;
+      string text = bench_program(test);
+      c->parse(text.data(), text.data() + text.size(), 1, error);
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      with_slot_set(*c, [&](auto slots) {
+	  bench_search<decltype(slots)>(*c, tso);
+	});
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cout << "{\"test\":\"" << name.str() << "\""
+	   << ",\"model\":\"" << (tso ? c->relaxed_name() : c->store_atomic_name()) << "\""
+	   << ",\"instructions\":" << c->num_slots
+	   << ",\"seconds\":" << seconds
+	   << ",\"leaves\":" << c->num_leaves
+	   << ",\"leaves_per_second\":" << (long long)(c->num_leaves / max(seconds, 1e-9))
+	   << ",\"states\":" << c->num_explored
+	   << ",\"pruned\":" << c->num_pruned
+	   << ",\"solutions\":" << (tso ? c->solutions_tso : c->solutions_ibm).size()
+	   << ",\"max_rss_kb\":" << max_rss_kb() << "}" << endl;
+    }
+  }
+}
+
+void check_input(CheckerContext& c, const CommandLine& cl) {
+  if (!cl.cache_dir.empty() && !c.has_target) {
+    check_cached(c, cl.num_jobs, cl.cache_dir);
+  } else {
+    check(c, cl.num_jobs);
+  }
+}
+
+// Checks a program of the standard input and prints its solutions.
+// The programs of a stream are reported one after the other.
+bool check_program(CheckerContext& c, const Test& test, const CommandLine& cl) {
+  c.reset();
+  string error;
+  if (!c.parse(test.begin, test.end, test.line, error)
+      || (!cl.query.empty() && !c.parse_target(cl.query, cl.query_models, error))
+      || (!cl.projection.empty() && !c.parse_projection(cl.projection, error))) {
+    cerr << "error: " << (test.name.empty() ? "" : test.name + ": ") << error << endl;
+    return false;
+  }
+  c.log = &cerr;
+  if (cl.binary_output) {
+    check_input(c, cl);
+    c.write_results(cout);
+    return true;
+  }
+  cout << "PROGRAM LOADED:" << endl;
+  c.print_program(cout);
+  cout << endl;
+
+  if (cl.streaming && !c.has_target) {
+    SolutionStream stream([&](bool relaxed, const int* values, size_t num_values) {
+	cout << (relaxed ? c.relaxed_name() : c.store_atomic_name()) << ": "
+	     << c.format_outcome(Outcome(values, values + num_values)) << '\n';
+      });
+    c.stream = &stream;
+    check(c, cl.num_jobs);
+    c.stream = NULL;
+    cout << endl;
+    cout << c.store_atomic_name() << " (STORE-ATOMIC) SOLUTIONS: " << stream.seen_ibm.size() << endl;
+    cout << c.relaxed_name() << " (WRITE-ATOMIC) SOLUTIONS: " << stream.seen_tso.size() << endl;
+    return true;
+  }
+  check_input(c, cl);
+  if (c.has_target) {
+    c.print_query(cout, cl.query);
+  } else {
+    c.print_solutions(cout);
+    if (cl.sampling()) c.print_coverage(cout);
+  }
+  return true;
+}
+
+#ifndef CHECKER_NO_MAIN
+void usage(char *name) {
+  cerr << "Usage: " << name << " [-p] [-j N] [-s] [-y] [-a | -F] [--samples N] [--time-budget S] [--checkpoint FILE [--resume]] [-B N] [-M MODEL] [-f FORMAT] [-c DIR] [-P TERMS] [-u | -q OUTCOME [-m MODEL]] < program" << endl;
+  cerr << "       " << name << " [-p] [-j N] [-s] [-y] [-a | -F] [--samples N] [--time-budget S] [-B N] [-M MODEL] [-f FORMAT] [-c DIR] [-P TERMS] [-q OUTCOME [-m MODEL]] -b DIR|MANIFEST|STREAM [-o DIR]" << endl;
+  cerr << "  -p    partial-order reduction of independent instructions" << endl;
+  cerr << "  -j N  explore with N worker threads (in batch mode, check N tests at a time)" << endl;
+  cerr << "  -M M  relaxed model: tso (against IBM370), pso or arm (ARM-lite)" << endl;
+  cerr << "  -s    run the IBM370 and TSO searches separately" << endl;
+  cerr << "  -y    symmetry reduction of identical threads, up to renaming the variables" << endl;
+  cerr << "  -u    print the solutions, unsorted, as soon as they are found" << endl;
+  cerr << "  -c D  keep the results in directory D and reuse those of equivalent programs" << endl;
+  cerr << "  -f F  output format: text, or bin for the binary results of README.md" << endl;
+  cerr << "  --bench  time the searches over a generated corpus of litmus shapes" << endl;
+  cerr << "  -a    axiomatic backend: enumerate reads-from and coherence orders" << endl;
+  cerr << "  -F    frontier engine: explore a level of the tree at a time, with -j workers" << endl;
+  cerr << "  --checkpoint F   save the state of the search to F every minute" << endl;
+  cerr << "  --checkpoint-interval S  save it every S seconds instead" << endl;
+  cerr << "  --resume         continue the search saved in the checkpoint, if any" << endl;
+  cerr << "  --samples N      only run N random executions (of each model with -s)" << endl;
+  cerr << "  --time-budget S  only run random executions for S seconds" << endl;
+  cerr << "  -B N  obtain TSO with explicit store buffers of N stores (0: unbounded)" << endl;
+  cerr << "  -b    check the .in files of a directory, the files listed in a manifest, or a stream" << endl;
+  cerr << "  -o    write batch results to DIR/<test>.out instead of JSON lines" << endl;
+  cerr << "  -q    only tell whether an outcome, such as \"x==1; y==0; [x]==2\", is allowed" << endl;
+  cerr << "  -m    ask the query about a single model (ibm or tso)" << endl;
+  cerr << "  -P T  only keep the terms T of the outcomes, such as \"x; [y]\", and skip what cannot change them" << endl;
+}
+
+int main (int argc, char *argv[]) {  
+  CommandLine cl;
+  string batch_path, output_dir;
+  bool bench = false;
+  for (int a = 1; a < argc; a++) {
+    string arg = argv[a];
+    if (arg == "-p") {
+      cl.por = true;
+    } else if (arg == "-j" && a + 1 < argc && atoi(argv[a+1]) > 0) {
+      cl.num_jobs = atoi(argv[++a]);
+    } else if (arg == "-s") {
+      cl.combined = false;
+    } else if (arg == "--bench") {
+      bench = true;
+    } else if (arg == "-y") {
+      cl.symmetry = true;
+    } else if (arg == "-u") {
+      cl.streaming = true;
+    } else if (arg == "-f" && a + 1 < argc && string(argv[a+1]) == "bin") {
+      cl.binary_output = true;
+      a++;
+    } else if (arg == "-f" && a + 1 < argc && string(argv[a+1]) == "text") {
+      cl.binary_output = false;
+      a++;
+    } else if (arg == "-M" && a + 1 < argc && string(argv[a+1]) == "tso") {
+      cl.model = RELAXED_TSO;
+      a++;
+    } else if (arg == "-M" && a + 1 < argc && string(argv[a+1]) == "pso") {
+      cl.model = RELAXED_PSO;
+      a++;
+    } else if (arg == "-M" && a + 1 < argc && string(argv[a+1]) == "arm") {
+      cl.model = RELAXED_ARM;
+      a++;
+    } else if (arg == "-c" && a + 1 < argc) {
+      cl.cache_dir = argv[++a];
+    } else if (arg == "-a") {
+      cl.axiomatic = true;
+    } else if (arg == "-F") {
+      cl.frontier = true;
+    } else if (arg == "--checkpoint" && a + 1 < argc) {
+      cl.checkpoint_path = argv[++a];
+    } else if (arg == "--checkpoint-interval" && a + 1 < argc && atof(argv[a+1]) > 0) {
+      cl.checkpoint_interval = atof(argv[++a]);
+    } else if (arg == "--resume") {
+      cl.resume = true;
+    } else if (arg == "--samples" && a + 1 < argc && atoll(argv[a+1]) > 0) {
+      cl.max_walks = atoll(argv[++a]);
+    } else if (arg == "--time-budget" && a + 1 < argc && atof(argv[a+1]) > 0) {
+      cl.time_budget = atof(argv[++a]);
+    } else if (arg == "-B" && a + 1 < argc && atoi(argv[a+1]) >= 0) {
+      cl.store_buffers = true;
+      cl.combined = false;
+      cl.buffer_depth = atoi(argv[++a]);
+    } else if (arg == "-b" && a + 1 < argc) {
+      batch_path = argv[++a];
+    } else if (arg == "-o" && a + 1 < argc) {
+      output_dir = argv[++a];
+    } else if (arg == "-q" && a + 1 < argc) {
+      cl.query = argv[++a];
+    } else if (arg == "-P" && a + 1 < argc) {
+      cl.projection = argv[++a];
+    } else if (arg == "-m" && a + 1 < argc && string(argv[a+1]) == "ibm") {
+      cl.query_models = QUERY_IBM;
+      a++;
+    } else if (arg == "-m" && a + 1 < argc && string(argv[a+1]) == "tso") {
+      cl.query_models = QUERY_TSO;
+      a++;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (cl.binary_output && (cl.streaming || !cl.query.empty()
+			   || (!batch_path.empty() && output_dir.empty()))) {
+    cerr << "-f bin only applies to the sorted solutions, and needs -o in batch mode" << endl;
+    return 1;
+  }
+
+  if (!cl.projection.empty() && (cl.binary_output || !cl.query.empty()
+				  || !cl.cache_dir.empty())) {
+    cerr << "-P does not apply to binary output, queries or -c" << endl;
+    return 1;
+  }
+
+  string error;
+  if (!validate_options(cl, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+
+  if (cl.sampling() && (!cl.query.empty() || !cl.cache_dir.empty())) {
+    cerr << "sampling does not apply to queries or -c" << endl;
+    return 1;
+  }
+
+  if (!cl.checkpoint_path.empty() && (cl.streaming || !cl.query.empty() || !batch_path.empty()
+				      || !cl.cache_dir.empty() || bench)) {
+    cerr << "--checkpoint only applies to the sorted solutions of a single program" << endl;
+    return 1;
+  }
+
+  if (bench) {
+    run_bench(cl);
+    return 0;
+  }
+
+  if (!batch_path.empty()) {
+    vector<string> paths;
+    if (!list_tests(batch_path, paths)) {
+      cerr << batch_path << ": cannot read tests" << endl;
+      return 1;
+    }
+    vector<unique_ptr<InputFile> > files;
+    vector<Test> tests;
+    load_tests(paths, files, tests);
+    run_batch(tests, output_dir, cl);
+    return 0;
+  }
+
+  unique_ptr<CheckerContext> c(new CheckerContext);
+  c->options = &cl;
+  InputFile input;
+  if (!input.open("")) {
+    cerr << "error: cannot read the program" << endl;
+    return 1;
+  }
+  vector<Test> tests;
+  split_programs(input, "", tests);
+  if (!cl.checkpoint_path.empty() && tests.size() > 1) {
+    cerr << "--checkpoint only applies to a single program" << endl;
+    return 1;
+  }
+  int status = 0;
+  for (size_t k = 0; k < tests.size(); k++) {
+    if (!tests[k].name.empty() && !cl.binary_output) {
+      cout << "=== " << tests[k].name << endl;
+    }
+    if (!check_program(*c, tests[k], cl)) {
+      status = 1;
+    }
+  }
+  return status;
 }
+#endif
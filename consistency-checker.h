@@ -0,0 +1,78 @@
+/** 
+ *  @file    consistency-checker.h
+ *  @author  Alberto Ros (aros@ditec.um.es)
+ *  
+ *  @section DESCRIPTION
+ *  
+ *  Library interface of the checker, for calling it in process.
+ *  Compile consistency-checker.cpp with -DCHECKER_NO_MAIN and link
+ *  it with the program.
+ *
+ */
+
+#ifndef CONSISTENCY_CHECKER_H
+#define CONSISTENCY_CHECKER_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Relaxed models, each checked against its store-atomic variant
+#define RELAXED_TSO 0 // against IBM370
+#define RELAXED_PSO 1
+#define RELAXED_ARM 2
+
+// Options of a check, those of the command line that change the
+// search (see the usage of the checker). Each call to check() reads its
+// own options, so calls with different options can run at once.
+struct CheckerOptions {
+  int model;                   // relaxed model, RELAXED_* (-M)
+  bool por;                    // partial-order reduction (-p)
+  bool combined;               // single search for both models (not -s)
+  int num_jobs;                // worker threads (-j)
+  bool symmetry;               // merge states that only differ in identical threads (-y)
+  bool store_buffers;          // TSO engine with explicit store buffers (-B)
+  int buffer_depth;            // maximum stores per buffer, 0 if unbounded
+  bool axiomatic;              // enumerate rf and co instead of interleavings (-a)
+  bool frontier;               // explore breadth first, a level at a time (-F)
+  long long max_walks;         // random executions per search (--samples), 0 if unbounded
+  double time_budget;          // seconds of random executions (--time-budget), 0 if unbounded
+  std::string checkpoint_path; // file the state of the search is saved to (--checkpoint), not with check()
+  double checkpoint_interval;  // seconds between two checkpoints
+  bool resume;                 // continue the search saved in checkpoint_path (--resume)
+
+  CheckerOptions() : model(RELAXED_TSO), por(false), combined(true), num_jobs(1),
+		     symmetry(false), store_buffers(false), buffer_depth(0),
+		     axiomatic(false), frontier(false), max_walks(0), time_budget(0),
+		     checkpoint_interval(60), resume(false) {}
+
+  // Random executions instead of all of them
+  bool sampling() const {
+    return max_walks > 0 || time_budget > 0;
+  }
+};
+
+// Receives every distinct outcome of a model once, as soon as it is
+// found: the final value of each variable, then the value of each
+// load in thread order (see ProgramLayout). relaxed is false for the
+// store-atomic variant. Calls are serialized, also with several
+// worker threads, and values only lives for the call.
+typedef std::function<void(bool relaxed, const int* values, size_t num_values)> OutcomeSink;
+
+// The meaning of the values of an outcome
+struct ProgramLayout {
+  std::vector<std::string> vars;           // in order of first use
+  std::vector<std::pair<int, int> > loads; // thread and instruction
+};
+
+// Checks a program, in the input format, under the relaxed model of
+// options and its store-atomic variant, and passes their outcomes to
+// sink. Returns false, with the reason in error, if the program is not
+// well formed or the options do not apply together, as on the command
+// line. The sink keeps no solutions, so there are no checkpoints.
+bool check(const std::string& program, const CheckerOptions& options,
+	   const OutcomeSink& sink, std::string& error, ProgramLayout* layout = NULL);
+
+#endif
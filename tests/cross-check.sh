@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Cross-checks the engines and search options of the checker on
+# generated programs: every option that only changes how the outcomes
+# are found must print the same solutions as the default search.
+#
+# Usage: tests/cross-check.sh [CHECKER] [GENERATE OPTIONS]
+#
+#   tests/cross-check.sh ./consistency-checker -n 200 -t 4 -i 3 -s 7
+#
+# The programs are generated by generate.py (see its options) as a
+# single stream, checked under every relaxed model. The default search
+# is compared with -s, -p, -s -p, -j, -y, -F and -F -j, and the
+# axiomatic backend with the store buffers of -B 0, whose TSO results
+# are the same (TSO only). Exits with 1 if any output differs.
+
+dir=$(dirname "$0")
+checker=${1:-./consistency-checker}
+[ $# -gt 0 ] && shift
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+python3 "$dir/generate.py" "$@" > "$tmp/tests.in" || exit 1
+status=0
+
+# compare NAME REFERENCE-OPTIONS OPTIONS
+compare() {
+  $checker $2 < "$tmp/tests.in" > "$tmp/ref.out" 2> /dev/null
+  $checker $3 < "$tmp/tests.in" > "$tmp/out" 2> /dev/null
+  if [ ! -s "$tmp/ref.out" ]; then
+    echo "FAIL  $1: no output from $checker ${2:-}"
+    status=1
+  elif cmp -s "$tmp/ref.out" "$tmp/out"; then
+    echo "ok    $1: $3"
+  else
+    echo "FAIL  $1: $3 differs from ${2:-the default}"
+    status=1
+  fi
+}
+
+for model in tso pso arm; do
+  for options in "-s" "-p" "-s -p" "-j 4" "-y" "-s -y" "-F" "-F -j 4" "-F -p"; do
+    compare "$model" "-M $model" "-M $model $options"
+  done
+done
+compare tso "-B 0" "-a"
+exit $status
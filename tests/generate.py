@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+#
+# Generates a stream of random litmus programs for the checker, each
+# introduced by a "=== NAME" line, on the standard output.
+#
+# Usage: generate.py [-n COUNT] [-t THREADS] [-i INSTRS] [-v VARS] [-s SEED]
+#
+# Every program has 2 to THREADS threads of 1 to INSTRS instructions,
+# over the variables x0 ... x<VARS-1>. Each store writes a value of its
+# own, so that outcomes tell the stores apart, except in the threads
+# that repeat an earlier one, as it is or with x0 and x1 swapped, so
+# that the symmetry reduction (-y) has something to find.
+
+import argparse
+import random
+
+
+SWAP = {"x0": "x1", "x1": "x0"}
+
+
+def program(rng, threads, instrs, num_vars):
+    bodies = []
+    value = 0
+    for _ in range(rng.randint(2, threads)):
+        body = []
+        if bodies and rng.random() < 0.3:
+            swap = rng.random() < 0.5
+            for op, var, val in rng.choice(bodies):
+                body.append((op, SWAP.get(var, var) if swap else var, val))
+        else:
+            for _ in range(rng.randint(1, instrs)):
+                var = "x%d" % rng.randrange(num_vars)
+                if rng.random() < 0.5:
+                    value += 1
+                    body.append(("st", var, value))
+                else:
+                    body.append(("ld", var, None))
+        bodies.append(body)
+    lines = []
+    for body in bodies:
+        for op, var, val in body:
+            lines.append("%s %s" % (op, var) if val is None else "%s %s %d" % (op, var, val))
+        lines.append("---")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate random litmus programs")
+    parser.add_argument("-n", type=int, default=50, help="number of programs")
+    parser.add_argument("-t", type=int, default=3, help="maximum threads")
+    parser.add_argument("-i", type=int, default=3, help="maximum instructions per thread")
+    parser.add_argument("-v", type=int, default=2, help="number of variables")
+    parser.add_argument("-s", type=int, default=1, help="random seed")
+    args = parser.parse_args()
+    rng = random.Random(args.s)
+    for k in range(args.n):
+        print("=== gen%d" % (k + 1))
+        print(program(rng, args.t, args.i, args.v))
+
+
+if __name__ == "__main__":
+    main()